@@ -0,0 +1,262 @@
+/*
+  Microbenchmark of the bridge data path, built and run by "make bench".
+
+  jopa.cpp is compiled in with its main() renamed. The JACK and PulseAudio
+  calls made on the data path are defined below; being part of the executable,
+  they take precedence over the shared libraries. The ringbuffer is jopa's
+  own.
+*/
+
+#define main jopa_main
+#include "jopa.cpp"
+#undef main
+
+// Stand-in state, set up by JopaBench::run
+static std::vector<char> bench_pulse_memory;       // What pa_stream_begin_write hands out
+static std::vector<char> bench_pulse_capture;      // What pa_stream_peek returns
+static size_t bench_pulse_readable = 0;
+
+extern "C" {
+
+void* jack_port_get_buffer(jack_port_t* port, jack_nframes_t) {
+    return reinterpret_cast<std::vector<float>*>(port)->data();
+}
+
+jack_nframes_t jack_last_frame_time(jack_client_t const*) {
+    return 0;
+}
+
+jack_nframes_t jack_frame_time(jack_client_t const*) {
+    return 0;
+}
+
+pa_stream_state_t pa_stream_get_state(pa_stream const*) {
+    // Keeps pulse_update_drift out of the measurement, it has no data path
+    return PA_STREAM_CREATING;
+}
+
+int pa_stream_begin_write(pa_stream*, void** data, size_t* nbytes) {
+    *data = bench_pulse_memory.data();
+    *nbytes = std::min(*nbytes, bench_pulse_memory.size());
+    return 0;
+}
+
+int pa_stream_write(pa_stream*, void const*, size_t, pa_free_cb_t, int64_t, pa_seek_mode_t) {
+    // Memory from pa_stream_begin_write is already shared with the server
+    return 0;
+}
+
+size_t pa_stream_readable_size(pa_stream const*) {
+    return bench_pulse_readable;
+}
+
+int pa_stream_peek(pa_stream*, void const** data, size_t* nbytes) {
+    *data = bench_pulse_capture.data();
+    *nbytes = bench_pulse_readable;
+    return 0;
+}
+
+int pa_stream_drop(pa_stream*) {
+    bench_pulse_readable = 0;
+    return 0;
+}
+
+}
+
+class JopaBench {
+
+public:
+
+    struct Config {
+
+        JopaSession::Direction direction;
+        pa_sample_format_t format;
+        unsigned channels;
+        jack_nframes_t period;
+        bool split_wrap;    // Start half a period plus one frame in, so the wrap splits callbacks
+
+    };
+
+    struct Result {
+
+        double jack_ns_per_frame;
+        double pulse_ns_per_frame;
+        uint64_t jack_ticks[2];     // 50th and 99th percentile
+        uint64_t pulse_ticks[2];
+
+    };
+
+    // Prints one row per combination of direction, format, channels, period and wrap position
+    static void sweep(unsigned iterations);
+    static Result run(Config const& config, unsigned iterations);
+
+private:
+
+    static uint64_t ticks();
+    static uint64_t nanoseconds();
+    static void percentiles(std::vector<uint64_t>& samples, uint64_t* result);
+
+};
+
+uint64_t JopaBench::ticks() {
+#ifdef JOPA_X86_KERNELS
+    return __rdtsc();
+#else
+    return nanoseconds();
+#endif
+}
+
+uint64_t JopaBench::nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void JopaBench::percentiles(std::vector<uint64_t>& samples, uint64_t* result) {
+    std::sort(samples.begin(), samples.end());
+    result[0] = samples[samples.size() / 2];
+    result[1] = samples[samples.size() * 99 / 100];
+}
+
+JopaBench::Result JopaBench::run(Config const& config, unsigned iterations) {
+    typedef JopaSession::Bridge Bridge;
+    static unsigned const warmup = 64;
+
+    JopaSession session;
+    session.num_channels = config.channels;
+    session.jack_buffer_size = config.period;
+    session.sample_kernels = JopaKernels::select(config.channels);
+    session.meter = JopaMeter::select();
+    session.add_bridge(config.direction, "", "");
+    Bridge* bridge = session.bridges[0];
+
+    // A test tone, so conversion and dither see realistic values
+    std::vector<std::vector<float>> port_buffers(config.channels, std::vector<float>(config.period));
+    for(unsigned ch = 0; ch < config.channels; ++ch) {
+        for(jack_nframes_t i = 0; i < config.period; ++i) {
+            port_buffers[ch][i] = 0.5f * std::sin((float) (i + ch) * 0.05f);
+        }
+        bridge->ports[ch] = reinterpret_cast<jack_port_t*>(&port_buffers[ch]);
+    }
+
+    bridge->sample_format = config.format;
+    if(config.format != PA_SAMPLE_FLOAT32NE) {
+        bridge->conceal_buffer.resize(JopaSession::conceal_buffer_frames * session.num_channels);
+        bridge->converter = JopaConverter::select(config.format);
+        JopaConverter::seed(&bridge->dither, 0);
+    }
+    // Never dereferenced by the stand-ins
+    bridge->stream = reinterpret_cast<pa_stream*>(bridge);
+    bridge->online = true;
+    bridge->active = true;
+
+    size_t pulse_frame_size = session.pulse_frame_size(bridge);
+    size_t pulse_nbytes = config.period * pulse_frame_size;
+    bridge->ringbuffer = JopaRing::create(session.ringbuffer_frames(config.period), config.channels, false);
+    bridge->jitter.reset(config.period);
+    bench_pulse_memory.assign(pulse_nbytes, 0);
+    bench_pulse_capture.assign(pulse_nbytes, 0);
+    if(config.format != PA_SAMPLE_FLOAT32NE) {
+        JopaConverter::DitherState dither;
+        JopaConverter::seed(&dither, 0);
+        bridge->converter.encode(bench_pulse_capture.data(), port_buffers[0].data(), std::min<size_t>(config.period, pulse_nbytes / bridge->converter.sample_size), &dither, 0.0f);
+    }
+    if(config.split_wrap) {
+        size_t skip = config.period / 2 + 1;
+        bridge->ringbuffer.load()->write_advance(skip);
+        bridge->ringbuffer.load()->read_advance(skip);
+    }
+
+    std::vector<uint64_t> jack_ticks;
+    std::vector<uint64_t> pulse_ticks;
+    uint64_t jack_ns = 0;
+    uint64_t pulse_ns = 0;
+    bool playback = config.direction == JopaSession::Direction::playback;
+    for(unsigned i = 0; i < warmup + iterations; ++i) {
+        // Playback flows JACK to PulseAudio, record the other way around
+        for(int side = 0; side < 2; ++side) {
+            bool jack_side = (side == 0) == playback;
+            uint64_t start_ns = nanoseconds();
+            uint64_t start_ticks = ticks();
+            if(jack_side) {
+                JopaSession::jack_on_process(config.period, &session);
+            } else if(playback) {
+                JopaSession::pulse_on_playback_writable(bridge->stream, pulse_nbytes, bridge);
+            } else {
+                bench_pulse_readable = pulse_nbytes;
+                JopaSession::pulse_on_record_readable(bridge->stream, pulse_nbytes, bridge);
+            }
+            uint64_t elapsed_ticks = ticks() - start_ticks;
+            uint64_t elapsed_ns = nanoseconds() - start_ns;
+            if(i < warmup) {
+                continue;
+            }
+            (jack_side ? jack_ticks : pulse_ticks).push_back(elapsed_ticks);
+            (jack_side ? jack_ns : pulse_ns) += elapsed_ns;
+        }
+    }
+
+    uint64_t xruns = 0;
+    for(unsigned type = 0; type < JopaSession::num_xrun_types; ++type) {
+        xruns += bridge->xrun_count[type].get();
+    }
+    if(xruns != 0) {
+        std::fprintf(stderr, "warning: %llu xruns during the benchmark, the numbers are off\n", (unsigned long long) xruns);
+    }
+
+    Result result;
+    result.jack_ns_per_frame = (double) jack_ns / ((double) iterations * config.period);
+    result.pulse_ns_per_frame = (double) pulse_ns / ((double) iterations * config.period);
+    percentiles(jack_ticks, result.jack_ticks);
+    percentiles(pulse_ticks, result.pulse_ticks);
+
+    // Keep the destructor away from the stand-ins
+    bridge->stream = nullptr;
+    for(unsigned ch = 0; ch < config.channels; ++ch) {
+        bridge->ports[ch] = nullptr;
+    }
+    return result;
+}
+
+void JopaBench::sweep(unsigned iterations) {
+    static JopaSession::Direction const directions[] = { JopaSession::Direction::playback, JopaSession::Direction::record };
+    static pa_sample_format_t const formats[] = { PA_SAMPLE_FLOAT32NE, PA_SAMPLE_S16NE, PA_SAMPLE_S32NE };
+    static unsigned const channel_counts[] = { 1, 2, 6, 8 };
+    static jack_nframes_t const periods[] = { 64, 256, 1024 };
+
+#ifdef JOPA_X86_KERNELS
+    std::printf("Ticks are TSC cycles per callback, %u iterations per row.\n\n", iterations);
+#else
+    std::printf("Ticks are nanoseconds per callback, %u iterations per row.\n\n", iterations);
+#endif
+    std::printf("%-8s %-9s %3s %6s %-7s  %12s %12s  %10s %10s  %10s %10s\n",
+        "stream", "format", "ch", "period", "wrap", "jack ns/fr", "pulse ns/fr", "jack p50", "jack p99", "pulse p50", "pulse p99");
+    for(JopaSession::Direction direction : directions) {
+        for(pa_sample_format_t format : formats) {
+            for(unsigned channels : channel_counts) {
+                for(jack_nframes_t period : periods) {
+                    for(bool split_wrap : { false, true }) {
+                        Config config = { direction, format, channels, period, split_wrap };
+                        Result result = run(config, iterations);
+                        std::printf("%-8s %-9s %3u %6u %-7s  %12.3f %12.3f  %10llu %10llu  %10llu %10llu\n",
+                            direction == JopaSession::Direction::playback ? "playback" : "record",
+                            pa_sample_format_to_string(format), channels, period, split_wrap ? "split" : "aligned",
+                            result.jack_ns_per_frame, result.pulse_ns_per_frame,
+                            (unsigned long long) result.jack_ticks[0], (unsigned long long) result.jack_ticks[1],
+                            (unsigned long long) result.pulse_ticks[0], (unsigned long long) result.pulse_ticks[1]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    unsigned iterations = argc > 1 ? (unsigned) std::strtoul(argv[1], nullptr, 10) : 2000;
+    if(iterations == 0) {
+        std::fprintf(stderr, "Usage: %s [ITERATIONS]\n", argv[0]);
+        return 1;
+    }
+    JopaBench::sweep(iterations);
+    return 0;
+}
@@ -17,71 +17,734 @@
 */
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <queue>
+#include <limits>
+#include <new>
 #include <stdexcept>
 #include <string>
+#include <vector>
+#include <ctime>
+#include <getopt.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <spawn.h>
 #include <unistd.h>
 #include <jack/jack.h>
-#include <jack/ringbuffer.h>
 #include <pulse/pulseaudio.h>
+#include <pulse/rtclock.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JOPA_X86_KERNELS
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define JOPA_NEON_KERNELS
+#endif
+
+// Every kernel family below has a portable scalar variant and faster ones for
+// particular CPUs. At startup each faster variant is run against the scalar one,
+// and any that does not produce bit-identical output, dither state included, is
+// passed over. So the CPU never changes the audio, and a miscompiled or buggy
+// variant costs speed rather than sound.
+class JopaVariants {
+
+public:
+
+    // An empty call, remainders on their own, and the vector body with every
+    // remainder length around it
+    static size_t const test_lengths[16];
+    static constexpr size_t max_test_length = 1023;
+
+    // The first candidate that verify accepts against the reference, or the reference
+    template<typename T, typename Verify>
+    static T select(T const& reference, T const* candidates, unsigned num_candidates, char const* kind, Verify verify);
+
+};
+
+// Converts between JACK's one-buffer-per-channel layout and PulseAudio's
+// interleaved frames
+class JopaKernels {
+
+public:
+
+    typedef void (*interleave_t)(float* dst, float* const* src, unsigned channels, size_t offset, size_t nframes);
+    typedef void (*deinterleave_t)(float* const* dst, float const* src, unsigned channels, size_t offset, size_t nframes);
+
+    char const* name;
+    interleave_t interleave;
+    deinterleave_t deinterleave;
+
+    static JopaKernels select(unsigned channels);
+
+private:
+
+    static bool verify(JopaKernels const& candidate, JopaKernels const& reference, unsigned channels);
+
+    static void interleave_scalar(float* dst, float* const* src, unsigned channels, size_t offset, size_t nframes);
+    static void deinterleave_scalar(float* const* dst, float const* src, unsigned channels, size_t offset, size_t nframes);
+    // Channel count known at compile time, so the inner loop unrolls
+    template<unsigned channels>
+    static void interleave_fixed(float* dst, float* const* src, unsigned, size_t offset, size_t nframes);
+    template<unsigned channels>
+    static void deinterleave_fixed(float* const* dst, float const* src, unsigned, size_t offset, size_t nframes);
+#ifdef JOPA_X86_KERNELS
+    static void interleave_stereo_sse2(float* dst, float* const* src, unsigned channels, size_t offset, size_t nframes);
+    static void deinterleave_stereo_sse2(float* const* dst, float const* src, unsigned channels, size_t offset, size_t nframes);
+    static void interleave_stereo_avx2(float* dst, float* const* src, unsigned channels, size_t offset, size_t nframes);
+    static void deinterleave_stereo_avx2(float* const* dst, float const* src, unsigned channels, size_t offset, size_t nframes);
+    static void interleave_octo_sse2(float* dst, float* const* src, unsigned channels, size_t offset, size_t nframes);
+    static void deinterleave_octo_sse2(float* const* dst, float const* src, unsigned channels, size_t offset, size_t nframes);
+#endif
+#ifdef JOPA_NEON_KERNELS
+    static void interleave_stereo_neon(float* dst, float* const* src, unsigned channels, size_t offset, size_t nframes);
+    static void deinterleave_stereo_neon(float* const* dst, float const* src, unsigned channels, size_t offset, size_t nframes);
+#endif
+
+};
+
+// Converts between the float samples kept in the ringbuffers and the integer
+// formats PulseAudio devices natively run at
+class JopaConverter {
+
+public:
+
+    // One xorshift32 generator per lane, sample i of a call uses lane i % dither_lanes
+    static constexpr unsigned dither_lanes = 8;
+
+    struct DitherState {
+
+        uint32_t lanes[dither_lanes];
+
+    };
+
+    // dither_scale is 1 for TPDF dither of one LSB peak, 0 for plain rounding
+    typedef void (*encode_t)(void* dst, float const* src, size_t nsamples, DitherState* dither, float dither_scale);
+    typedef void (*decode_t)(float* dst, void const* src, size_t nsamples);
+
+    char const* name;
+    size_t sample_size;
+    encode_t encode;
+    decode_t decode;
+
+    // format is either PA_SAMPLE_S16NE or PA_SAMPLE_S32NE
+    static JopaConverter select(pa_sample_format_t format);
+    static void seed(DitherState* dither, uint32_t seed);
+
+private:
+
+    static bool verify(JopaConverter const& candidate, JopaConverter const& reference);
+
+    static void encode_s16_scalar(void* dst, float const* src, size_t nsamples, DitherState* dither, float dither_scale);
+    static void decode_s16_scalar(float* dst, void const* src, size_t nsamples);
+    static void encode_s32_scalar(void* dst, float const* src, size_t nsamples, DitherState* dither, float dither_scale);
+    static void decode_s32_scalar(float* dst, void const* src, size_t nsamples);
+#ifdef JOPA_X86_KERNELS
+    static void encode_s16_sse2(void* dst, float const* src, size_t nsamples, DitherState* dither, float dither_scale);
+    static void decode_s16_sse2(float* dst, void const* src, size_t nsamples);
+    static void encode_s16_avx2(void* dst, float const* src, size_t nsamples, DitherState* dither, float dither_scale);
+    static void encode_s32_sse2(void* dst, float const* src, size_t nsamples, DitherState* dither, float dither_scale);
+    static void decode_s32_sse2(float* dst, void const* src, size_t nsamples);
+#endif
+
+};
+
+// Measures the level of JACK port buffers
+class JopaMeter {
+
+public:
+
+    struct Level {
+
+        float peak;
+        float energy;   // Sum of squares
+
+    };
+
+    // Largest absolute sample value, NaN is ignored
+    typedef float (*peak_t)(float const* src, size_t nframes);
+    // Peak and energy in one pass. NaN is ignored by the peak and carried into the
+    // energy. Every variant sums squares in eight lanes, so the rounding is the same.
+    typedef Level (*level_t)(float const* src, size_t nframes);
+
+    char const* name;
+    peak_t peak;
+    level_t level;
+
+    static JopaMeter select();
+
+private:
+
+    static bool verify(JopaMeter const& candidate, JopaMeter const& reference);
+
+    static Level finish_level(float peak, float const* lanes, float const* tail, size_t tail_nframes);
+
+    static float peak_scalar(float const* src, size_t nframes);
+    static Level level_scalar(float const* src, size_t nframes);
+#ifdef JOPA_X86_KERNELS
+    static float peak_sse2(float const* src, size_t nframes);
+    static Level level_sse2(float const* src, size_t nframes);
+    static float peak_avx2(float const* src, size_t nframes);
+    static Level level_avx2(float const* src, size_t nframes);
+#endif
+#ifdef JOPA_NEON_KERNELS
+    static float peak_neon(float const* src, size_t nframes);
+    static Level level_neon(float const* src, size_t nframes);
+#endif
+
+};
+
+// Lock-free queue between exactly one producer thread and one consumer thread.
+// Storage is preallocated, so neither side ever allocates or blocks.
+template<typename T, size_t capacity>
+class JopaSpscQueue {
+
+private:
+
+    static_assert((capacity & (capacity - 1)) == 0, "Capacity must be a power of two");
+
+    T slots[capacity];
+    // Keep the indices on separate cache lines, each written by one side only
+    alignas(64) std::atomic<size_t> read_index{0};
+    alignas(64) std::atomic<size_t> write_index{0};
+
+public:
+
+    // Returns false if the queue is full
+    bool push(T const& item);
+    // Returns false if the queue is empty
+    bool pop(T& item);
+
+};
+
+// Ringbuffer of interleaved float frames between exactly one producer thread and
+// one consumer thread. The storage is mapped twice back to back, so whatever is
+// readable or writable is one contiguous span, across the wraparound too. Each side
+// keeps a copy of the other side's index on its own cache line, and only reloads
+// it when the copy shows too little room.
+class JopaRing {
+
+private:
+
+    float* data = nullptr;
+    size_t capacity = 0;        // Frames, a power of two
+    size_t frame_samples = 0;
+    size_t mapping_size = 0;    // Bytes of one of the two mappings
+    // Written by the producer only
+    alignas(64) std::atomic<size_t> write_index{0};
+    size_t cached_read_index = 0;
+    // Written by the consumer only
+    alignas(64) std::atomic<size_t> read_index{0};
+    size_t cached_write_index = 0;
+
+    JopaRing() = default;
+    ~JopaRing();
+
+public:
+
+    // Room for at least min_frames frames, returns nullptr on failure.
+    // With populate, every page is faulted in right away.
+    static JopaRing* create(size_t min_frames, unsigned channels, bool populate);
+    static void destroy(JopaRing* ring);
+
+    // Producer side: at least wanted frames if that many are free, exact otherwise
+    size_t write_space(size_t wanted = std::numeric_limits<size_t>::max());
+    float* write_pointer() const;
+    void write_advance(size_t nframes);
+    // Consumer side: at least wanted frames if that many are queued, exact otherwise
+    size_t read_space(size_t wanted = std::numeric_limits<size_t>::max());
+    float* read_pointer() const;
+    void read_advance(size_t nframes);
+
+    // Frames queued, from any thread
+    size_t fill() const;
+    size_t frames() const;
+    // Only while neither side is running
+    void reset();
+    bool lock();
+
+};
+
+// Statistics counter with one writer thread and any number of readers.
+// A relaxed load and store avoids a locked instruction on the writer side.
+class JopaCounter {
+
+private:
+
+    std::atomic<uint64_t> value{0};
+
+public:
+
+    void add(uint64_t n);
+    void set(uint64_t n);
+    uint64_t get() const;
+
+};
+
+// Peak and RMS level of each channel, published by one writer thread for any
+// number of readers. Readers retry while the sequence number is odd or has moved
+// on during the read, so the writer never waits.
+class JopaLevels {
+
+private:
+
+    std::atomic<uint32_t> sequence{0};
+    std::atomic<float> peak[PA_CHANNELS_MAX] = {};
+    std::atomic<float> rms[PA_CHANNELS_MAX] = {};
+
+public:
+
+    void publish(float const* new_peak, float const* new_rms, unsigned channels);
+    void read(float* out_peak, float* out_rms, unsigned channels) const;
+
+};
+
+// Label, application and device name of a bridge as shown in the statistics, published
+// the same way as JopaLevels. Application slots are renamed while the statistics thread
+// reads them, which must not wait for the PulseAudio mainloop lock. Longer names are cut.
+class JopaNames {
+
+private:
+
+    static constexpr size_t name_max = 256;
+    std::atomic<uint32_t> sequence{0};
+    std::atomic<char> label[name_max] = {};
+    std::atomic<char> application[name_max] = {};
+    std::atomic<char> device[name_max] = {};
+
+    static void store(std::atomic<char>* name, std::string const& value);
+    static std::string load(std::atomic<char> const* name);
+
+public:
+
+    void publish(std::string const& new_label, std::string const& new_application, std::string const& new_device);
+    void read(std::string* out_label, std::string* out_application, std::string* out_device) const;
+
+};
 
 class JopaSession {
 
+    // Drives the data path with stand-ins for JACK and PulseAudio, see bench.cpp
+    friend class JopaBench;
+
 private:
 
     typedef jack_default_audio_sample_t jack_sample_t;
     typedef float pulse_sample_t;
-    static constexpr unsigned num_channels = 2;
-    static constexpr unsigned ringbuffer_fragments = 2;
-    jack_nframes_t sample_rate = 48000;
-    jack_nframes_t jack_buffer_size = 1024;
+    unsigned num_channels = 2;
+    pa_channel_map channel_map;
+    // Length of the crossfade when a ringbuffer resize has to drop samples
+    static constexpr unsigned ringbuffer_crossfade_frames = 64;
+    // Length of the fades around a gap caused by an underflow
+    static constexpr unsigned conceal_fade_frames = 64;
+    // Concealment for integer streams is encoded in pieces of this many frames
+    static constexpr unsigned conceal_buffer_frames = 1024;
+    // Clock drift compensation, see DriftController
+    static constexpr pa_usec_t drift_settle_time = 2 * PA_USEC_PER_SEC;
+    static constexpr pa_usec_t drift_update_interval = PA_USEC_PER_SEC;
+    static constexpr double drift_filter_time = 1.0;
+    static constexpr double drift_proportional_gain = 0.1;
+    static constexpr double drift_integral_gain = 0.005;
+    static constexpr double drift_max_correction = 0.001;
+    // Written by the JACK callbacks, read by the statistics thread without a lock
+    std::atomic<jack_nframes_t> sample_rate{48000};
+    std::atomic<jack_nframes_t> jack_buffer_size{1024};
+    // Bounds of the jitter buffer, see JitterController
+    double min_latency = 0;
+    double max_latency = 0.2;
+    // Stream sample format, see pulse_choose_format
+    bool use_native_format = true;
+    bool use_dither = true;
+    static constexpr pa_usec_t jitter_grow_holdoff = PA_USEC_PER_SEC;
+    static constexpr pa_usec_t jitter_stable_time = 60 * PA_USEC_PER_SEC;
+    static constexpr pa_usec_t jitter_shrink_interval = 10 * PA_USEC_PER_SEC;
+    // Playback is corked after this long below the threshold, 0 never corks, see jack_on_process.
+    // The threshold is half an LSB of 16-bit audio.
+    double idle_suspend = 5;
+    static constexpr float idle_threshold = 1.0f / 65536;
+    // With --meter, port levels are measured over windows of this many seconds
+    bool metering = false;
+    static constexpr double level_window = 0.1;
+    // Record and monitor streams are delayed to match the slowest of them, offsets
+    // below the step size are left to the drift controller to close smoothly
+    static constexpr double align_step_frames = 32;
+
+    // Steers the PulseAudio stream sample rate so that the amount of audio
+    // queued between JACK and PulseAudio (ringbuffer + PulseAudio stream buffer)
+    // stays at a constant level, no matter how far the two clocks drift apart
+    class DriftController {
+
+    private:
+
+        pa_usec_t settle_until = 0;
+        pa_usec_t last_sample = 0;
+        pa_usec_t last_update = 0;
+        double baseline_sum = 0;
+        unsigned baseline_count = 0;
+        double baseline = 0;
+        double filtered = 0;
+        double integral = 0;
+        bool settled = false;
+
+    public:
+
+        // Fractional rate correction, positive if too much audio is queued
+        double correction = 0;
+        uint32_t applied_rate = 0;
+
+        void reset();
+        bool update(double ring_fill, double ring_target, double pulse_fill, double rate, pa_usec_t now);
+        // Accounts for audio inserted into or dropped from the ringbuffer in one go
+        void shift(double frames);
+        bool is_settled() const;
+        // How much PulseAudio keeps buffered by itself, in frames
+        double pulse_baseline() const;
+
+    };
+
+    // Picks how much audio the ringbuffer should hold: jumps up by half a period
+    // on an underflow and creeps back down after a long time without trouble,
+    // so quiet hosts get low latency and noisy hosts stop glitching
+    class JitterController {
+
+    private:
+
+        uint64_t last_underflows = 0;
+        pa_usec_t last_underflow = 0;
+        pa_usec_t last_change = 0;
+
+    public:
+
+        // Target ringbuffer fill in frames
+        uint32_t target = 0;
+
+        void reset(uint32_t initial_target);
+        void clamp(uint32_t min_target, uint32_t max_target);
+        bool update(uint64_t underflows, uint32_t min_target, uint32_t max_target, uint32_t period, pa_usec_t now);
+
+    };
+
+    // Kinds of buffer trouble reported through the xrun event queues
+    enum XrunType {
+        xrun_overflow,
+        xrun_underflow,
+        xrun_hole,
+        num_xrun_types
+    };
+    static constexpr pa_usec_t xrun_report_interval = PA_USEC_PER_SEC;
+    // Ringbuffer fill level in tenths, process callback time in power-of-two microseconds
+    static constexpr unsigned stats_fill_buckets = 10;
+    static constexpr unsigned stats_time_buckets = 16;
+
+    enum class Direction {
+        playback,   // JACK to a PulseAudio sink
+        record,     // PulseAudio source to JACK
+        monitor     // Monitor source of a PulseAudio sink to JACK
+    };
+
+    // Life cycle of an application slot. The PulseAudio thread claims a slot and
+    // releases it, the worker thread creates and removes its JACK ports.
+    enum class AppState {
+        unused,
+        attaching,
+        attached,
+        detaching
+    };
+
+    // One PulseAudio stream with its own group of JACK ports and ringbuffer
+    struct Bridge {
+
+        JopaSession* session;
+        Direction direction;
+        std::string label;      // Prefix of the JACK port names, empty for the default devices
+        std::string device;     // PulseAudio sink or source name, empty for the default device
+        std::string name;       // Used in error messages and stream names
+        std::string title;      // Used in log messages
+        jack_port_t* ports[PA_CHANNELS_MAX] = { nullptr };
+        // Swapped by jack_on_buffer_size while the JACK process thread may be running
+        std::atomic<JopaRing*> ringbuffer{nullptr};
+        pa_stream* stream = nullptr;
+        // Set once the stream is ready, cleared while PulseAudio reconnects
+        std::atomic<bool> online{false};
+        // Retries this stream alone once its device went missing or the stream failed,
+        // see pulse_fail_stream. Touched with the mainloop lock held.
+        pa_time_event* retry_event = nullptr;
+        pa_usec_t retry_delay = reconnect_delay_min;
+        pa_usec_t ready_time = 0;       // Since when the stream is ready, zero otherwise
+        // Cleared for record and monitor by the worker thread while no port is connected,
+        // and for playback by the JACK process thread after idle_suspend seconds of silence.
+        // The stream is corked and the copies are skipped meanwhile, see update_activity.
+        std::atomic<bool> active{true};
+        bool corked = false;            // Touched with the mainloop lock held
+        // Cleared while an application slot is unused, the ports do not exist then
+        std::atomic<bool> attached{true};
+        // Monitor bridges only, set from the sink info, see app_update
+        uint32_t sink_index = PA_INVALID_INDEX;
+        std::string monitor_source;
+        // Application slots only, see --app-ports. Touched with the mainloop lock held,
+        // except that the worker thread reads them while the slot is attaching.
+        bool application = false;
+        AppState app_state = AppState::unused;
+        Bridge* parent = nullptr;       // Monitor bridge of the sink the application plays to
+        uint32_t sink_input = PA_INVALID_INDEX;
+        pa_sample_format_t app_format = PA_SAMPLE_FLOAT32NE;
+        std::string app_name;
+        // Only touched by the JACK process thread
+        bool ports_silenced = false;
+        uint64_t silent_frames = 0;
+        DriftController drift;
+        JitterController jitter;
+        // Sample format of the PulseAudio stream, the ringbuffer always holds floats
+        pa_sample_format_t sample_format = PA_SAMPLE_FLOAT32NE;
+        JopaConverter converter = {};
+        JopaConverter::DitherState dither = {};
+        std::vector<pulse_sample_t> conceal_buffer;     // Sized when the stream connects
+        // Underflow concealment, owned by the thread reading the ringbuffer
+        pulse_sample_t conceal_frame[PA_CHANNELS_MAX] = { 0 };
+        bool conceal_fade_in = false;
+        // Window being metered, only touched by the JACK process thread
+        float level_peak[PA_CHANNELS_MAX] = { 0 };
+        double level_energy[PA_CHANNELS_MAX] = { 0 };
+        uint32_t level_frames = 0;
+        // Statistics, see format_stats
+        JopaLevels levels;      // The last complete metering window
+        JopaNames names;
+        JopaCounter xrun_count[num_xrun_types];
+        JopaCounter fill_histogram[stats_fill_buckets];
+        JopaCounter pulse_latency;
+        JopaCounter target_fill;
+        // End-to-end latency in frames, measured by the PulseAudio thread
+        // and published to the JACK graph by the worker thread
+        JopaCounter latency;
+        JopaCounter reported_latency;
+        // Record and monitor only, see align_capture
+        JopaCounter align_offset;
+        // Only touched by the PulseAudio thread
+        double source_latency = 0;      // Device side PulseAudio latency in frames, smoothed
+        pa_usec_t source_latency_time = 0;
+        double align_frames = 0;        // Delay added to line up with the other streams
+        uint32_t align_jitter_target = 0;   // Jitter target when align_frames was last set
+        size_t align_skip = 0;          // Frames still to drop from incoming audio
+        // Only touched by the worker thread
+        pa_usec_t xrun_last_report[num_xrun_types] = { 0 };
+        unsigned xrun_suppressed[num_xrun_types] = { 0 };
+
+    };
+
+    // Filled before the PulseAudio mainloop starts and fixed from then on, so the
+    // process callback and the PulseAudio thread can iterate without locking
+    std::vector<Bridge*> bridges;
+    void add_bridge(Direction direction, std::string const& label, std::string const& device);
 
     jack_client_t* jack_client = nullptr;
-    jack_port_t* jack_playback_ports[num_channels] = { nullptr };
-    jack_port_t* jack_capture_ports[num_channels] = { nullptr };
-    jack_port_t* jack_monitor_ports[num_channels] = { nullptr };
-    jack_ringbuffer_t* jack_playback_ringbuffer = nullptr;
-    jack_ringbuffer_t* jack_capture_ringbuffer = nullptr;
-    jack_ringbuffer_t* jack_monitor_ringbuffer = nullptr;
+    JopaKernels sample_kernels;
+    JopaMeter meter;
+    JopaCounter jack_cycles;
+    JopaCounter jack_xruns;
+    JopaCounter process_time_max;
+    JopaCounter process_time_histogram[stats_time_buckets];
+
+    void ringbuffer_write_interleaved(JopaRing* ringbuffer, jack_sample_t* const* jack_buffer, jack_nframes_t nframes) const;
+    void ringbuffer_read_interleaved(JopaRing* ringbuffer, jack_sample_t* const* jack_buffer, jack_nframes_t nframes) const;
+    void ringbuffer_transfer(JopaRing* from, JopaRing* to, size_t max_frames) const;
+    // For a given JACK buffer size, so jack_on_buffer_size can size ringbuffers ahead
+    uint32_t jitter_min_target(jack_nframes_t buffer_size) const;
+    uint32_t jitter_max_target(jack_nframes_t buffer_size) const;
+    size_t ringbuffer_frames(jack_nframes_t buffer_size) const;
+
+    // Ringbuffers replaced on a buffer size change are freed by the worker thread
+    // once the JACK process thread has finished the cycle that may still use them
+    struct RetiredRingbuffer {
+
+        JopaRing* ringbuffer;
+        uint64_t cycle;
+
+    };
+
+    JopaSpscQueue<RetiredRingbuffer, 64> retired_ringbuffers;
+    std::vector<RetiredRingbuffer> retired_ringbuffers_pending;   // Only touched by the worker thread
+    void free_retired_ringbuffers(bool force);
 
     static void jack_on_shutdown(void* arg);
     static int jack_on_process(jack_nframes_t nframes, void* arg);
     static int jack_on_buffer_size(jack_nframes_t nframes, void* arg);
     static int jack_on_sample_rate(jack_nframes_t nframes, void* arg);
     static void jack_on_port_connect(jack_port_id_t a, jack_port_id_t b, int connect, void* arg);
+    static int jack_on_xrun(void* arg);
+    static void jack_on_latency(jack_latency_callback_mode_t mode, void* arg);
+    void estimate_latency(Bridge* bridge);
+    void report_latency();
     static void jack_on_error(char const* reason);
+    bool jack_register_ports(Bridge* bridge);
+
+    // Real-time priority of the PulseAudio mainloop thread, 0 for normal scheduling.
+    // JACK picks the priority of its process thread itself, jopa only pins it.
+    int pulse_rt_priority = 10;
+    cpu_set_t pulse_cpus = {};
+    cpu_set_t jack_cpus = {};
+    static void pulse_on_mainloop_start(pa_mainloop_api* api, void* userdata);
+    static void thread_schedule(pthread_t thread, char const* title, int rt_priority, cpu_set_t const* cpus);
+
+    // With --mlock, everything mapped at the end of init() is locked. Without an
+    // unlimited RLIMIT_MEMLOCK, later mappings are not, so ringbuffers replaced on
+    // a buffer size change are locked one by one.
+    static constexpr size_t prefault_stack_size = 64 * 1024;
+    bool lock_memory = false;
+    bool locked_future = false;
+    void memory_lock();
+    JopaRing* ringbuffer_create(size_t nframes) const;
+    static void prefault_stack();
+    static void jack_on_thread_init(void* arg);
+
+    // A JACK server started by jopa runs at the rate of the default sink, with a period
+    // close to half its latency. Both are polled for at short intervals during startup.
+    static constexpr pa_usec_t startup_poll_interval = 10 * PA_USEC_PER_MSEC;
+    static constexpr pa_usec_t startup_sink_timeout = 500 * PA_USEC_PER_MSEC;
+    static constexpr pa_usec_t startup_jack_timeout = 5 * PA_USEC_PER_SEC;
+    bool default_sink_known = false;        // Touched with the mainloop lock held
+    jack_nframes_t default_sink_rate = 0;
+    pa_usec_t default_sink_latency = 0;
+    jack_client_t* jack_start_server();
 
     pa_threaded_mainloop* pulse_mainloop = nullptr;
     pa_context* pulse_context = nullptr;
-    pa_stream* pulse_playback_stream = nullptr;
-    pa_stream* pulse_record_stream = nullptr;
-    pa_stream* pulse_monitor_stream = nullptr;
+
+    // A lost server tears down every stream and the context, then reconnects after
+    // a delay that doubles up to the maximum. A missing device or failed stream only
+    // retries that stream, with a delay of its own. The delays start over once the
+    // streams stayed ready for reconnect_stable_time, so a failure right after the
+    // connection came up keeps backing off. The JACK client stays active throughout.
+    // Touched with the mainloop lock held.
+    static constexpr pa_usec_t reconnect_delay_min = 20 * PA_USEC_PER_MSEC;
+    static constexpr pa_usec_t reconnect_delay_max = 2 * PA_USEC_PER_SEC;
+    static constexpr pa_usec_t reconnect_stable_time = 10 * PA_USEC_PER_SEC;
+    pa_usec_t reconnect_delay = reconnect_delay_min;
+    pa_usec_t pulse_ready_time = 0;     // Since when all streams are ready, zero otherwise
+    bool pulse_reconnecting = false;
+    // The context connects while JACK starts up, streams wait for the JACK client to be active
+    bool jack_active = false;
+    void pulse_connect_context();
+    void pulse_create_streams();
+    bool pulse_query_device(Bridge* bridge);
+    void pulse_disconnect();
+    void pulse_disconnect_stream(Bridge* bridge);
+    void pulse_fail(char const* reason);
+    void pulse_fail_stream(Bridge* bridge, char const* reason);
+    bool pulse_streams_ready();
+    static void pulse_on_reconnect_timer(pa_mainloop_api* api, pa_time_event* e, timeval const* tv, void* userdata);
+    static void pulse_on_retry_timer(pa_mainloop_api* api, pa_time_event* e, timeval const* tv, void* userdata);
 
     static void pulse_on_context_state(pa_context* c, void* userdata);
+    static void pulse_on_stream_state(pa_stream* p, void* userdata);
     static void pulse_on_playback_writable(pa_stream* p, size_t nbytes, void* userdata);
+    void pulse_resume_playback(Bridge* bridge, size_t nframes);
+    void pulse_conceal_playback(Bridge* bridge, pulse_sample_t* data, size_t nframes);
+    bool pulse_write_concealed(Bridge* bridge, size_t nframes);
+    void conceal_record(Bridge* bridge, jack_sample_t* const* jack_buffer, jack_nframes_t available, jack_nframes_t nframes) const;
+    float meter_levels(Bridge* bridge, jack_sample_t* const* jack_buffer, jack_nframes_t nframes) const;
+    void reset_levels(Bridge* bridge) const;
     static void pulse_on_record_readable(pa_stream* p, size_t nbytes, void* userdata);
-    static void pulse_on_monitor_readable(pa_stream* p, size_t nbytes, void* userdata);
-    static void pulse_on_playback_stream_moved(pa_stream* p, void* userdata);
-    static void pulse_on_record_stream_moved(pa_stream* p, void* userdata);
+    static void pulse_on_stream_moved(pa_stream* p, void* userdata);
     static void pulse_on_get_sink_info(pa_context* c, pa_sink_info const* i, int eol, void* userdata);
+    static void pulse_on_get_source_info(pa_context* c, pa_source_info const* i, int eol, void* userdata);
+    static void pulse_on_get_default_sink_info(pa_context* c, pa_sink_info const* i, int eol, void* userdata);
+    void pulse_connect_stream(Bridge* bridge, pa_sample_format_t native_format, char const* device);
+    void pulse_write_playback(Bridge* bridge, size_t nframes);
+    void pulse_read_converted(Bridge* bridge, void const* data, size_t nframes);
+
+    void pulse_update_drift(Bridge* bridge);
+    double align_capture(Bridge* bridge, double source_latency, pa_usec_t now);
+    void ringbuffer_write_silence(JopaRing* ringbuffer, size_t nframes) const;
+
+    // The audio paths never print, they post fixed-size records which the
+    // worker thread formats and rate-limits
+    struct XrunEvent {
+
+        XrunType type;
+        Bridge* bridge;
+        size_t available;
+        size_t required;
+        jack_nframes_t frame_time;
+
+    };
+
+    typedef JopaSpscQueue<XrunEvent, 256> XrunEventQueue;
+    XrunEventQueue jack_xrun_events;    // Produced by the JACK process thread
+    XrunEventQueue pulse_xrun_events;   // Produced by the PulseAudio mainloop thread
+    std::atomic<unsigned> xrun_events_dropped{0};
+    void post_xrun(XrunEventQueue& queue, XrunType type, Bridge* bridge, size_t available, size_t required, jack_nframes_t frame_time);
+    void drain_xrun_events();
+
+    // Statistics are served as text to anyone connecting to a Unix socket
+    std::string stats_socket_path;
+    int stats_socket = -1;
+    pthread_t stats_thread;
+    bool stats_started = false;
+    std::string format_stats() const;
+    static void* stats_main(void* arg);
+
+    // Port connections are mirrored by a worker thread, because
+    // jack_connect must not be called from any JACK callback
+    static constexpr size_t jack_port_name_max = 320;
 
     struct JackConnectOperation {
 
-        std::string port_name_a;
-        std::string port_name_b;
+        char port_name_a[jack_port_name_max];
+        char port_name_b[jack_port_name_max];
         bool connect;
 
     };
 
-    std::queue<JackConnectOperation> jack_connect_operations;
+    JopaSpscQueue<JackConnectOperation, 64> jack_connect_operations;
+    sem_t worker_wakeup;
+    pthread_t worker_thread;
+    bool worker_started = false;
+    std::atomic<bool> worker_quit{false};
     void jack_schedule_connect(char const* port_name_a, char const* port_name_b, bool connect);
-    void jack_finish_connect();
+    static void* worker_main(void* arg);
+
+    // Set by jack_on_port_connect and on playback going idle or resuming,
+    // the worker thread then corks or uncorks streams to match
+    std::atomic<bool> activity_changed{true};
+    void update_activity();
+    void pulse_apply_activity(Bridge* bridge);
+    void capture_reset(Bridge* bridge);
+
+    // With --app-ports, every application playing to a bridged sink gets its own
+    // monitor port group. Slots are preallocated bridges, so the JACK process thread
+    // can keep walking a fixed list. The worker thread registers and unregisters
+    // their ports, jack_port_register must not be called with the mainloop lock held.
+    static constexpr unsigned app_slots_max = 16;
+    static constexpr size_t app_name_max = 32;
+    bool app_ports = false;
+
+    struct AppOperation {
+
+        Bridge* bridge;
+        bool attach;
+
+    };
+
+    // Pushed with the mainloop lock held, which keeps it single-producer. A slot has
+    // at most an attach and a detach pending, so the queue never fills up.
+    JopaSpscQueue<AppOperation, 2 * app_slots_max> app_operations;
+    static void pulse_on_subscribe(pa_context* c, pa_subscription_event_type_t t, uint32_t idx, void* userdata);
+    static void pulse_on_get_sink_input_info(pa_context* c, pa_sink_input_info const* i, int eol, void* userdata);
+    void app_update(pa_sink_input_info const* i);
+    void app_remove(uint32_t sink_input);
+    void app_schedule(Bridge* bridge, bool attach);
+    void app_attach(Bridge* bridge);
+    void app_detach(Bridge* bridge);
 
     class PulseThreadedMainloopLocker {
 
@@ -98,13 +761,42 @@ private:
 
     static bool pulse_is_stream_ready(pa_stream* p);
     static bool pulse_check_operation(pa_operation* o);
-    static void pulse_throw_exception(pa_context* c, char const* reason);
-    pa_sample_spec pulse_calc_sample_spec() const;
-    pa_buffer_attr pulse_calc_buffer_attr(bool record) const;
+    pa_sample_format_t pulse_choose_format(pa_sample_format_t native_format) const;
+    pa_sample_spec pulse_calc_sample_spec(pa_sample_format_t format) const;
+    size_t pulse_frame_size(Bridge const* bridge) const;
+    pa_buffer_attr pulse_calc_buffer_attr(Bridge const* bridge) const;
 
 public:
 
-    void init();
+    struct Options {
+
+        struct Device {
+
+            bool sink;
+            std::string label;
+            std::string name;
+
+        };
+
+        unsigned channels = 0;
+        char const* channel_map = nullptr;
+        std::vector<Device> devices;
+        char const* stats_socket = nullptr;
+        int rt_priority = 10;
+        cpu_set_t pulse_cpus = {};      // Empty to leave the affinity alone
+        cpu_set_t jack_cpus = {};
+        bool native_format = true;
+        bool dither = true;
+        bool lock_memory = false;
+        bool app_ports = false;
+        bool metering = false;
+        double min_latency = -1;
+        double max_latency = -1;
+        double idle_suspend = -1;
+
+    };
+
+    void init(Options const& options);
     void run();
     ~JopaSession();
 
@@ -112,45 +804,316 @@ public:
 
 extern char** environ;
 
-int main() {
+static void print_usage(char const* program) {
+    std::fprintf(stderr,
+        "Usage: %s [options]\n"
+        "\n"
+        "Options:\n"
+        "  -c, --channels=N         number of channels on each port group (default: 2,\n"
+        "                           or the size of the channel map)\n"
+        "  -m, --channel-map=MAP    PulseAudio channel map, e.g. \"surround-51\" or\n"
+        "                           \"front-left,front-right,lfe\"\n"
+        "  -s, --sink=[LABEL=]NAME  bridge a PulseAudio sink to LABEL_playback_* and\n"
+        "                           LABEL_monitor_* ports, may be repeated\n"
+        "  -S, --source=[LABEL=]NAME\n"
+        "                           bridge a PulseAudio source to LABEL_capture_* ports,\n"
+        "                           may be repeated\n"
+        "  -l, --min-latency=MS     lower bound of the adaptive ringbuffer (default: 0)\n"
+        "  -L, --max-latency=MS     upper bound of the adaptive ringbuffer (default: 200)\n"
+        "  -i, --idle-suspend=SECONDS\n"
+        "                           cork the playback stream after this much silence,\n"
+        "                           so the sink can suspend, 0 to never (default: 5)\n"
+        "  -F, --float              always open PulseAudio streams as 32-bit float,\n"
+        "                           instead of the native format of each device\n"
+        "  -D, --no-dither          round instead of dither when converting to 16-bit\n"
+        "  -M, --mlock              lock and pre-fault the memory used by the audio path\n"
+        "  -A, --app-ports          give every application playing to a bridged sink its\n"
+        "                           own APP.INDEX_monitor_* ports\n"
+        "  -e, --meter              measure peak and RMS levels of every port group for\n"
+        "                           the statistics\n"
+        "  -P, --rt-priority=N      real-time priority of the PulseAudio thread, 0 for\n"
+        "                           normal scheduling (default: 10)\n"
+        "  -C, --pulse-cpus=LIST    pin the PulseAudio thread to CPUs, e.g. \"2,3\" or \"2-3\"\n"
+        "  -J, --jack-cpus=LIST     pin the JACK process thread to CPUs\n"
+        "  -t, --stats-socket=PATH  serve live statistics on a Unix socket\n"
+        "  -T, --print-stats=PATH   print the statistics of a running jopa and exit\n"
+        "  -h, --help               show this help\n"
+        "\n"
+        "Without --sink or --source, the default sink and source are bridged to\n"
+        "unprefixed ports. \"@DEFAULT_SINK@\" and \"@DEFAULT_SOURCE@\" name the defaults.\n",
+        program);
+}
+
+static JopaSession::Options::Device parse_device(bool sink, char const* arg) {
+    JopaSession::Options::Device device;
+    device.sink = sink;
+    char const* separator = std::strchr(arg, '=');
+    if(separator != nullptr) {
+        device.label.assign(arg, separator);
+        device.name = separator + 1;
+    } else {
+        device.label = arg;
+        device.name = arg;
+    }
+    return device;
+}
+
+static bool parse_cpu_list(char const* arg, cpu_set_t* cpus) {
+    CPU_ZERO(cpus);
+    char const* p = arg;
+    do {
+        char* end;
+        unsigned long first = std::strtoul(p, &end, 10);
+        unsigned long last = first;
+        if(end != p && *end == '-') {
+            p = end + 1;
+            last = std::strtoul(p, &end, 10);
+        }
+        if(end == p || first > last || last >= CPU_SETSIZE || (*end != ',' && *end != '\0')) {
+            std::fprintf(stderr, "Invalid CPU list: %s\n", arg);
+            return false;
+        }
+        for(unsigned long cpu = first; cpu <= last; ++cpu) {
+            CPU_SET(cpu, cpus);
+        }
+        p = end + 1;
+    } while(p[-1] == ',');
+    return true;
+}
+
+static int print_stats(char const* path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path, sizeof address.sun_path - 1);
+    if(fd < 0 || connect(fd, (sockaddr const*) &address, sizeof address) != 0) {
+        std::fprintf(stderr, "Unable to connect to %s\n", path);
+        return 1;
+    }
+    char buffer[4096];
+    ssize_t nbytes;
+    while((nbytes = read(fd, buffer, sizeof buffer)) > 0) {
+        std::fwrite(buffer, 1, nbytes, stdout);
+    }
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    static option const long_options[] = {
+        { "channels",    required_argument, nullptr, 'c' },
+        { "channel-map", required_argument, nullptr, 'm' },
+        { "sink",        required_argument, nullptr, 's' },
+        { "source",      required_argument, nullptr, 'S' },
+        { "min-latency", required_argument, nullptr, 'l' },
+        { "max-latency", required_argument, nullptr, 'L' },
+        { "idle-suspend", required_argument, nullptr, 'i' },
+        { "float",       no_argument,       nullptr, 'F' },
+        { "no-dither",   no_argument,       nullptr, 'D' },
+        { "mlock",       no_argument,       nullptr, 'M' },
+        { "app-ports",   no_argument,       nullptr, 'A' },
+        { "meter",       no_argument,       nullptr, 'e' },
+        { "rt-priority", required_argument, nullptr, 'P' },
+        { "pulse-cpus",  required_argument, nullptr, 'C' },
+        { "jack-cpus",   required_argument, nullptr, 'J' },
+        { "stats-socket", required_argument, nullptr, 't' },
+        { "print-stats", required_argument, nullptr, 'T' },
+        { "help",        no_argument,       nullptr, 'h' },
+        { nullptr,       0,                 nullptr, 0 }
+    };
+
+    JopaSession::Options options;
+    int opt;
+    while((opt = getopt_long(argc, argv, "c:m:s:S:l:L:i:FDMAeP:C:J:t:T:h", long_options, nullptr)) != -1) {
+        switch(opt) {
+        case 'c':
+            options.channels = std::strtoul(optarg, nullptr, 10);
+            if(options.channels == 0 || options.channels > PA_CHANNELS_MAX) {
+                std::fprintf(stderr, "Channel count must be between 1 and %u\n", PA_CHANNELS_MAX);
+                return 1;
+            }
+            break;
+        case 'm':
+            options.channel_map = optarg;
+            break;
+        case 's':
+        case 'S':
+            options.devices.push_back(parse_device(opt == 's', optarg));
+            if(options.devices.back().label.empty() || options.devices.back().name.empty()) {
+                std::fprintf(stderr, "Invalid device: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+        case 'L': {
+            char* end;
+            double latency = std::strtod(optarg, &end) / 1000;
+            if(end == optarg || *end != '\0' || !(latency >= 0)) {
+                std::fprintf(stderr, "Invalid latency: %s\n", optarg);
+                return 1;
+            }
+            (opt == 'l' ? options.min_latency : options.max_latency) = latency;
+            break;
+        }
+        case 'i': {
+            char* end;
+            double seconds = std::strtod(optarg, &end);
+            if(end == optarg || *end != '\0' || !(seconds >= 0)) {
+                std::fprintf(stderr, "Invalid idle time: %s\n", optarg);
+                return 1;
+            }
+            options.idle_suspend = seconds;
+            break;
+        }
+        case 'F':
+            options.native_format = false;
+            break;
+        case 'D':
+            options.dither = false;
+            break;
+        case 'M':
+            options.lock_memory = true;
+            break;
+        case 'A':
+            options.app_ports = true;
+            break;
+        case 'e':
+            options.metering = true;
+            break;
+        case 'P': {
+            char* end;
+            long priority = std::strtol(optarg, &end, 10);
+            if(end == optarg || *end != '\0' || priority < 0 || priority > sched_get_priority_max(SCHED_FIFO)) {
+                std::fprintf(stderr, "Real-time priority must be between 0 and %d\n", sched_get_priority_max(SCHED_FIFO));
+                return 1;
+            }
+            options.rt_priority = (int) priority;
+            break;
+        }
+        case 'C':
+        case 'J':
+            if(!parse_cpu_list(optarg, opt == 'C' ? &options.pulse_cpus : &options.jack_cpus)) {
+                return 1;
+            }
+            break;
+        case 't':
+            options.stats_socket = optarg;
+            break;
+        case 'T':
+            return print_stats(optarg);
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if(optind != argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if(options.min_latency >= 0 && options.max_latency >= 0 && options.min_latency > options.max_latency) {
+        std::fprintf(stderr, "Minimum latency must not exceed maximum latency\n");
+        return 1;
+    }
+    if(options.devices.empty()) {
+        options.devices.push_back({ true, "", "" });
+        options.devices.push_back({ false, "", "" });
+    }
+
     JopaSession session;
-    session.init();
+    session.init(options);
     session.run();
     return 0;
 }
 
-void JopaSession::init() {
+void JopaSession::init(Options const& options) {
     jack_set_error_function(jack_on_error);
 
-    // Try to use the default JACK server
+    // Decide channel layout
+    if(options.channel_map != nullptr) {
+        if(pa_channel_map_parse(&channel_map, options.channel_map) == nullptr) {
+            throw std::runtime_error("Invalid PulseAudio channel map");
+        }
+        if(options.channels != 0 && options.channels != channel_map.channels) {
+            throw std::runtime_error("Channel count does not match the channel map");
+        }
+    } else {
+        // PulseAudio has no default map beyond 6 channels, pad with aux channels
+        if(pa_channel_map_init_extend(&channel_map, options.channels != 0 ? options.channels : 2, PA_CHANNEL_MAP_DEFAULT) == nullptr) {
+            throw std::runtime_error("Unable to create a PulseAudio channel map");
+        }
+    }
+    num_channels = channel_map.channels;
+
+    // Every sink gets a playback and a monitor bridge, every source a record bridge
+    for(Options::Device const& device : options.devices) {
+        if(device.sink) {
+            add_bridge(Direction::playback, device.label, device.name);
+        }
+    }
+    for(Options::Device const& device : options.devices) {
+        if(!device.sink) {
+            add_bridge(Direction::record, device.label, device.name);
+        }
+    }
+    for(Options::Device const& device : options.devices) {
+        if(device.sink) {
+            add_bridge(Direction::monitor, device.label, device.name);
+        }
+    }
+    // Unused until an application shows up. Created here as well, the PulseAudio
+    // thread walks the bridges from the moment the mainloop starts.
+    app_ports = options.app_ports;
+    if(app_ports) {
+        for(unsigned slot = 0; slot < app_slots_max; ++slot) {
+            add_bridge(Direction::monitor, "", "");
+            Bridge* bridge = bridges.back();
+            bridge->application = true;
+            bridge->attached = false;
+            bridge->name = "application " + std::to_string(slot + 1);
+            bridge->title = "Application " + std::to_string(slot + 1);
+        }
+    }
+
+    pulse_rt_priority = options.rt_priority;
+    pulse_cpus = options.pulse_cpus;
+    jack_cpus = options.jack_cpus;
+    lock_memory = options.lock_memory;
+
+    // Bring up PulseAudio first, the context connects while JACK starts
+    pulse_mainloop = pa_threaded_mainloop_new();
+    if(pulse_mainloop == nullptr) {
+        throw std::runtime_error("Unable to create a PulseAudio event loop");
+    }
+    if(pa_threaded_mainloop_start(pulse_mainloop) < 0) {
+        throw std::runtime_error("Unable to run PulseAudio event loop");
+    }
+    {
+        PulseThreadedMainloopLocker locker(pulse_mainloop);
+        pa_mainloop_api_once(pa_threaded_mainloop_get_api(pulse_mainloop), pulse_on_mainloop_start, this);
+        pulse_connect_context();
+    }
+
+    // Try to use the default JACK server, or start one
     jack_client = jack_client_open("JACK over PulseAudio", JackNoStartServer, nullptr);
     if(jack_client == nullptr) {
-        // Create a new JACK server
-        pid_t jack_server_pid;
-        static char const* const jack_server_argv[] = {"jackd", "-T", "-d", "dummy", "-p", "1024", NULL};
-        if(posix_spawnp(&jack_server_pid, "jackd", nullptr, nullptr, const_cast<char* const*>(jack_server_argv), environ) != 0) {
-            throw std::runtime_error("Unable to start a JACK server");
-        }
-        // Try to use the newly started JACK server
-        for(int i = 0; i < 5; ++i) {
-            jack_client = jack_client_open("JACK over PulseAudio", JackNoStartServer, nullptr);
-            if(jack_client != nullptr) {
-                break;
-            } else {
-                sleep(1);
-            }
-        }
+        jack_client = jack_start_server();
     }
     if(jack_client == nullptr) {
         throw std::runtime_error("Unable to connect to the JACK server");
     }
 
-    struct sched_param sched_parameters;
-    memset(&sched_parameters, 0, sizeof sched_parameters);
-    sched_parameters.sched_priority = 10;
-    if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &sched_parameters) != 0) {
-        std::fprintf(stderr, "Cannot use real-time scheduling (FIFO at priority 10)\n");
+    // Start the worker before any JACK notification can arrive
+    if(sem_init(&worker_wakeup, 0, 0) != 0) {
+        throw std::runtime_error("Unable to create a semaphore");
     }
+    if(pthread_create(&worker_thread, nullptr, worker_main, this) != 0) {
+        throw std::runtime_error("Unable to create the worker thread");
+    }
+    worker_started = true;
 
     // Register callbacks
     ::jack_on_shutdown(jack_client, this->jack_on_shutdown, this);
@@ -166,61 +1129,252 @@ void JopaSession::init() {
     if(jack_set_port_connect_callback(jack_client, jack_on_port_connect, this) != 0) {
         throw std::runtime_error("Unable to register JACK callback functions");
     }
+    if(jack_set_xrun_callback(jack_client, jack_on_xrun, this) != 0) {
+        throw std::runtime_error("Unable to register JACK callback functions");
+    }
+    if(jack_set_latency_callback(jack_client, jack_on_latency, this) != 0) {
+        throw std::runtime_error("Unable to register JACK callback functions");
+    }
+    if(jack_set_thread_init_callback(jack_client, jack_on_thread_init, this) != 0) {
+        throw std::runtime_error("Unable to register JACK callback functions");
+    }
 
     // Get JACK server information
     sample_rate = jack_get_sample_rate(jack_client);
     jack_buffer_size = jack_get_buffer_size(jack_client);
-
-    // Create JACK ports
-    for(unsigned ch = 0; ch < num_channels; ++ch) {
-        std::string port_name = "playback_";
-        port_name += std::to_string(ch + 1);
-        jack_playback_ports[ch] = jack_port_register(jack_client, port_name.c_str(), JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput | JackPortIsTerminal, 0);
-        if(jack_playback_ports[ch] == nullptr) {
-            throw std::runtime_error("Unable to create JACK playback ports");
-        }
+    use_native_format = options.native_format;
+    use_dither = options.dither;
+    if(options.min_latency >= 0) {
+        min_latency = options.min_latency;
     }
-    for(unsigned ch = 0; ch < num_channels; ++ch) {
-        std::string port_name = "capture_";
-        port_name += std::to_string(ch + 1);
-        jack_capture_ports[ch] = jack_port_register(jack_client, port_name.c_str(), JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput | JackPortIsTerminal, 0);
-        if(jack_capture_ports[ch] == nullptr) {
-            throw std::runtime_error("Unable to create JACK capture ports");
-        }
+    if(options.max_latency >= 0) {
+        max_latency = options.max_latency;
     }
-    for(unsigned ch = 0; ch < num_channels; ++ch) {
-        std::string port_name = "monitor_";
-        port_name += std::to_string(ch + 1);
-        jack_monitor_ports[ch] = jack_port_register(jack_client, port_name.c_str(), JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
-        if(jack_monitor_ports[ch] == nullptr) {
-            throw std::runtime_error("Unable to create JACK monitor ports");
-        }
+    if(min_latency > max_latency) {
+        max_latency = min_latency;
+    }
+    if(options.idle_suspend >= 0) {
+        idle_suspend = options.idle_suspend;
     }
+    metering = options.metering;
 
-    // Create JACK ringbuffers
-    jack_playback_ringbuffer = jack_ringbuffer_create(jack_buffer_size * (num_channels * sizeof (pulse_sample_t) * ringbuffer_fragments));
-    if(jack_playback_ringbuffer == nullptr) {
-        throw std::runtime_error("Unable to create JACK playback buffer");
+    // Create JACK ports, application slots get theirs once an application shows up
+    for(Bridge* bridge : bridges) {
+        if(!bridge->application && !jack_register_ports(bridge)) {
+            throw std::runtime_error("Unable to create JACK " + bridge->name + " ports");
+        }
     }
-    jack_capture_ringbuffer = jack_ringbuffer_create(jack_buffer_size * (num_channels * sizeof (pulse_sample_t) * ringbuffer_fragments));
-    if(jack_capture_ringbuffer == nullptr) {
-        throw std::runtime_error("Unable to create JACK capture buffer");
+
+    // Pick interleave kernels
+    sample_kernels = JopaKernels::select(num_channels);
+    std::fprintf(stderr, "Using %s sample kernels.\n", sample_kernels.name);
+    meter = JopaMeter::select();
+    std::fprintf(stderr, "Using %s level meter.\n", meter.name);
+
+    // Create JACK ringbuffers, large enough for the maximum jitter buffer target
+    for(Bridge* bridge : bridges) {
+        bridge->ringbuffer = ringbuffer_create(ringbuffer_frames(jack_buffer_size));
+        if(bridge->ringbuffer == nullptr) {
+            throw std::runtime_error("Unable to create JACK " + bridge->name + " buffer");
+        }
+        bridge->jitter.reset(std::max(jitter_min_target(jack_buffer_size), std::min<uint32_t>(jack_buffer_size, jitter_max_target(jack_buffer_size))));
+        bridge->target_fill.set(bridge->jitter.target);
+        estimate_latency(bridge);
+        bridge->reported_latency.set(bridge->latency.get());
     }
-    jack_monitor_ringbuffer = jack_ringbuffer_create(jack_buffer_size * (num_channels * sizeof (pulse_sample_t) * ringbuffer_fragments));
-    if(jack_monitor_ringbuffer == nullptr) {
-        throw std::runtime_error("Unable to create JACK monitor buffer");
+
+    // Serve statistics
+    if(options.stats_socket != nullptr) {
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof address);
+        address.sun_family = AF_UNIX;
+        if(std::strlen(options.stats_socket) >= sizeof address.sun_path) {
+            throw std::runtime_error("Statistics socket path is too long");
+        }
+        std::strcpy(address.sun_path, options.stats_socket);
+        unlink(options.stats_socket);
+        stats_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(stats_socket < 0 || bind(stats_socket, (sockaddr const*) &address, sizeof address) != 0 || listen(stats_socket, 4) != 0) {
+            throw std::runtime_error("Unable to create the statistics socket");
+        }
+        stats_socket_path = options.stats_socket;
+        if(pthread_create(&stats_thread, nullptr, stats_main, this) != 0) {
+            throw std::runtime_error("Unable to create the statistics thread");
+        }
+        stats_started = true;
     }
 
     // Activate JACK event loop
     if(jack_activate(jack_client) != 0) {
         throw std::runtime_error("Unable to activate the JACK event loop");
     }
+    thread_schedule(jack_client_thread_id(jack_client), "JACK process", 0, &jack_cpus);
+    if(lock_memory) {
+        memory_lock();
+    }
 
-    // Create PulseAudio mainloop
-    pulse_mainloop = pa_threaded_mainloop_new();
-    if(pulse_mainloop == nullptr) {
-        throw std::runtime_error("Unable to create a PulseAudio event loop");
+    // The context is likely ready by now, otherwise it creates the streams itself
+    PulseThreadedMainloopLocker locker(pulse_mainloop);
+    jack_active = true;
+    if(pulse_context != nullptr && pa_context_get_state(pulse_context) == PA_CONTEXT_READY) {
+        pulse_create_streams();
+    }
+}
+
+void JopaSession::pulse_on_mainloop_start(pa_mainloop_api*, void* userdata) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(userdata);
+    thread_schedule(pthread_self(), "PulseAudio", self->pulse_rt_priority, &self->pulse_cpus);
+    if(self->lock_memory) {
+        prefault_stack();
+    }
+}
+
+void JopaSession::jack_on_thread_init(void* arg) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(arg);
+    if(self->lock_memory) {
+        prefault_stack();
+    }
+}
+
+void JopaSession::prefault_stack() {
+    // Touch the stack below the caller, so the audio callbacks never grow into fresh pages
+    char stack[prefault_stack_size];
+    std::memset(stack, 0, sizeof stack);
+    // Keeps the compiler from dropping the unused array
+    __asm__ __volatile__("" : : "r"(stack) : "memory");
+}
+
+void JopaSession::memory_lock() {
+    // Locking future mappings too could make thread creation and PulseAudio
+    // allocations fail once the limit is hit, so only do that without a limit
+    rlimit limit;
+    bool unlimited = getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur == RLIM_INFINITY;
+    if(mlockall(unlimited ? MCL_CURRENT | MCL_FUTURE : MCL_CURRENT) == 0) {
+        locked_future = unlimited;
+    } else {
+        std::fprintf(stderr, "Cannot lock all memory (RLIMIT_MEMLOCK is %llu KiB): %s\n", (unsigned long long) limit.rlim_cur / 1024, std::strerror(errno));
+        // Fall back to the ringbuffers and jopa's own code
+        extern char __executable_start;
+        extern char etext;
+        uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        uintptr_t text_start = (uintptr_t) &__executable_start & ~(page_size - 1);
+        if(mlock((void const*) text_start, (uintptr_t) &etext - text_start) != 0) {
+            std::fprintf(stderr, "Cannot lock code pages: %s\n", std::strerror(errno));
+        }
+        for(Bridge* bridge : bridges) {
+            if(!bridge->ringbuffer.load()->lock()) {
+                std::fprintf(stderr, "Cannot lock JACK %s buffer: %s\n", bridge->name.c_str(), std::strerror(errno));
+            }
+        }
+    }
+
+    // VmLck counts what actually got locked
+    FILE* status = std::fopen("/proc/self/status", "r");
+    if(status != nullptr) {
+        char line[256];
+        unsigned long locked_kib;
+        while(std::fgets(line, sizeof line, status) != nullptr) {
+            if(std::sscanf(line, "VmLck: %lu kB", &locked_kib) == 1) {
+                std::fprintf(stderr, "Locked %lu KiB of memory%s.\n", locked_kib, locked_future ? ", including future allocations" : "");
+                break;
+            }
+        }
+        std::fclose(status);
+    }
+}
+
+JopaRing* JopaSession::ringbuffer_create(size_t nframes) const {
+    // With --mlock, fault in every page now rather than on the first wraparound
+    JopaRing* ringbuffer = JopaRing::create(nframes, num_channels, lock_memory);
+    if(ringbuffer == nullptr || !lock_memory) {
+        return ringbuffer;
+    }
+    if(!locked_future && !ringbuffer->lock()) {
+        std::fprintf(stderr, "Cannot lock a ringbuffer: %s\n", std::strerror(errno));
+    }
+    return ringbuffer;
+}
+
+void JopaSession::thread_schedule(pthread_t thread, char const* title, int rt_priority, cpu_set_t const* cpus) {
+    if(rt_priority > 0) {
+        sched_param parameters;
+        std::memset(&parameters, 0, sizeof parameters);
+        parameters.sched_priority = rt_priority;
+        int error = pthread_setschedparam(thread, SCHED_FIFO, &parameters);
+        if(error != 0) {
+            std::fprintf(stderr, "Cannot use real-time scheduling for the %s thread (FIFO at priority %d): %s\n", title, rt_priority, std::strerror(error));
+        }
+    }
+    if(CPU_COUNT(cpus) != 0) {
+        int error = pthread_setaffinity_np(thread, sizeof *cpus, cpus);
+        if(error != 0) {
+            std::fprintf(stderr, "Cannot set the CPU affinity of the %s thread: %s\n", title, std::strerror(error));
+        }
+    }
+
+    // Report what the thread actually got
+    int policy;
+    sched_param parameters;
+    cpu_set_t affinity;
+    if(pthread_getschedparam(thread, &policy, &parameters) != 0 || pthread_getaffinity_np(thread, sizeof affinity, &affinity) != 0) {
+        return;
+    }
+    std::string cpu_list;
+    for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if(CPU_ISSET(cpu, &affinity)) {
+            cpu_list += (cpu_list.empty() ? "" : ",") + std::to_string(cpu);
+        }
+    }
+    char const* policy_name = policy == SCHED_FIFO ? "SCHED_FIFO" : policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER";
+    std::fprintf(stderr, "%s thread runs %s at priority %d on CPUs %s.\n", title, policy_name, parameters.sched_priority, cpu_list.c_str());
+}
+
+jack_client_t* JopaSession::jack_start_server() {
+    // Wait briefly for the default sink, a missing PulseAudio server must not hold up JACK
+    jack_nframes_t rate = 48000;
+    jack_nframes_t period = 1024;
+    for(pa_usec_t waited = 0; waited < startup_sink_timeout; waited += startup_poll_interval) {
+        {
+            PulseThreadedMainloopLocker locker(pulse_mainloop);
+            if(default_sink_known) {
+                rate = default_sink_rate;
+                if(default_sink_latency != 0) {
+                    // Power of two nearest to half the sink latency
+                    double half_latency = (double) default_sink_latency * rate / (2 * PA_USEC_PER_SEC);
+                    period = 1 << std::max(6L, std::min(12L, std::lround(std::log2(half_latency))));
+                }
+                break;
+            }
+        }
+        usleep(startup_poll_interval);
     }
+
+    // Create a new JACK server
+    std::string rate_arg = std::to_string(rate);
+    std::string period_arg = std::to_string(period);
+    char const* const jack_server_argv[] = {"jackd", "-T", "-d", "dummy", "-r", rate_arg.c_str(), "-p", period_arg.c_str(), NULL};
+    pid_t jack_server_pid;
+    if(posix_spawnp(&jack_server_pid, "jackd", nullptr, nullptr, const_cast<char* const*>(jack_server_argv), environ) != 0) {
+        throw std::runtime_error("Unable to start a JACK server");
+    }
+    std::fprintf(stderr, "Started a JACK server at %u Hz with %u sample periods.\n", rate, period);
+
+    // Try to use the newly started JACK server, failed attempts are expected and not worth printing
+    jack_client_t* client = nullptr;
+    jack_set_error_function([](char const*) {});
+    for(pa_usec_t waited = 0; waited < startup_jack_timeout; waited += startup_poll_interval) {
+        client = jack_client_open("JACK over PulseAudio", JackNoStartServer, nullptr);
+        int status;
+        if(client != nullptr || waitpid(jack_server_pid, &status, WNOHANG) == jack_server_pid) {
+            break;
+        }
+        usleep(startup_poll_interval);
+    }
+    jack_set_error_function(jack_on_error);
+    return client;
+}
+
+void JopaSession::pulse_connect_context() {
     // Create PulseAudio context
     pulse_context = pa_context_new(pa_threaded_mainloop_get_api(pulse_mainloop), "JACK over PulseAudio");
     if(pulse_context == nullptr) {
@@ -229,15 +1383,165 @@ void JopaSession::init() {
     // Connect to PulseAudio server
     pa_context_set_state_callback(pulse_context, pulse_on_context_state, this);
     if(pa_context_connect(pulse_context, nullptr, PA_CONTEXT_NOFLAGS, nullptr) < 0) {
-        pulse_throw_exception(pulse_context, "Unable to connect to the PulseAudio server");
+        pulse_fail("Unable to connect to the PulseAudio server");
     }
 }
 
-void JopaSession::run() {
-    if(pa_threaded_mainloop_start(pulse_mainloop) < 0) {
-        throw std::runtime_error("Unable to run PulseAudio event loop");
+void JopaSession::pulse_disconnect() {
+    for(Bridge* bridge : bridges) {
+        // The new context retries every stream anyway
+        if(bridge->retry_event != nullptr) {
+            pa_mainloop_api* api = pa_threaded_mainloop_get_api(pulse_mainloop);
+            api->time_free(bridge->retry_event);
+            bridge->retry_event = nullptr;
+        }
+        pulse_disconnect_stream(bridge);
+        // Sink input indices do not survive a reconnect, applications are picked up anew
+        if(bridge->app_state == AppState::attaching || bridge->app_state == AppState::attached) {
+            app_schedule(bridge, false);
+        }
+        bridge->sink_index = PA_INVALID_INDEX;
+    }
+    pulse_ready_time = 0;
+    if(pulse_context != nullptr) {
+        pa_context_set_subscribe_callback(pulse_context, nullptr, nullptr);
+        pa_context_set_state_callback(pulse_context, nullptr, nullptr);
+        pa_context_disconnect(pulse_context);
+        pa_context_unref(pulse_context);
+        pulse_context = nullptr;
+    }
+}
+
+void JopaSession::pulse_disconnect_stream(Bridge* bridge) {
+    bridge->online.store(false, std::memory_order_release);
+    bridge->ready_time = 0;
+    if(bridge->stream != nullptr) {
+        pa_stream_set_state_callback(bridge->stream, nullptr, nullptr);
+        pa_stream_set_write_callback(bridge->stream, nullptr, nullptr);
+        pa_stream_set_read_callback(bridge->stream, nullptr, nullptr);
+        pa_stream_set_moved_callback(bridge->stream, nullptr, nullptr);
+        pa_stream_disconnect(bridge->stream);
+        pa_stream_unref(bridge->stream);
+        bridge->stream = nullptr;
+    }
+}
+
+void JopaSession::pulse_fail(char const* reason) {
+    // Only schedules the reconnect, the context and streams stay valid
+    // until the timer fires, so the failing callback can simply return
+    if(pulse_reconnecting) {
+        return;
+    }
+    pulse_reconnecting = true;
+    std::fprintf(stderr, "%s: %s\n", reason, pa_strerror(pa_context_errno(pulse_context)));
+    for(Bridge* bridge : bridges) {
+        bridge->online.store(false, std::memory_order_release);
+    }
+
+    if(pulse_ready_time != 0 && pa_rtclock_now() - pulse_ready_time >= reconnect_stable_time) {
+        reconnect_delay = reconnect_delay_min;
+    }
+    std::fprintf(stderr, "Reconnecting to PulseAudio in %.0lf ms.\n", reconnect_delay / 1000.0);
+    timeval deadline;
+    pa_timeval_add(pa_gettimeofday(&deadline), reconnect_delay);
+    pa_mainloop_api* api = pa_threaded_mainloop_get_api(pulse_mainloop);
+    api->time_new(api, &deadline, pulse_on_reconnect_timer, this);
+    reconnect_delay = reconnect_delay * 2 < reconnect_delay_max ? reconnect_delay * 2 : reconnect_delay_max;
+}
+
+void JopaSession::pulse_on_reconnect_timer(pa_mainloop_api* api, pa_time_event* e, timeval const*, void* userdata) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(userdata);
+
+    api->time_free(e);
+    self->pulse_disconnect();
+    self->pulse_reconnecting = false;
+    self->pulse_connect_context();
+}
+
+void JopaSession::pulse_fail_stream(Bridge* bridge, char const* reason) {
+    // Like pulse_fail for a single stream, the context and the other streams carry on.
+    // The server kills the stream of an application which went away, that slot is freed
+    // instead of retried.
+    if(bridge->application) {
+        app_remove(bridge->sink_input);
+        return;
+    }
+    if(pulse_reconnecting || bridge->retry_event != nullptr) {
+        return;
+    }
+    std::fprintf(stderr, "%s: %s\n", reason, pa_strerror(pa_context_errno(pulse_context)));
+    bridge->online.store(false, std::memory_order_release);
+
+    if(bridge->ready_time != 0 && pa_rtclock_now() - bridge->ready_time >= reconnect_stable_time) {
+        bridge->retry_delay = reconnect_delay_min;
+    }
+    bridge->ready_time = 0;
+    std::fprintf(stderr, "Retrying %s stream in %.0lf ms.\n", bridge->title.c_str(), bridge->retry_delay / 1000.0);
+    timeval deadline;
+    pa_timeval_add(pa_gettimeofday(&deadline), bridge->retry_delay);
+    pa_mainloop_api* api = pa_threaded_mainloop_get_api(pulse_mainloop);
+    bridge->retry_event = api->time_new(api, &deadline, pulse_on_retry_timer, bridge);
+    bridge->retry_delay = bridge->retry_delay * 2 < reconnect_delay_max ? bridge->retry_delay * 2 : reconnect_delay_max;
+    if(pulse_ready_time == 0 && pulse_streams_ready()) {
+        pulse_ready_time = pa_rtclock_now();
+    }
+}
+
+void JopaSession::pulse_on_retry_timer(pa_mainloop_api* api, pa_time_event* e, timeval const*, void* userdata) {
+    Bridge* bridge = reinterpret_cast<Bridge*>(userdata);
+    JopaSession* self = bridge->session;
+
+    api->time_free(e);
+    bridge->retry_event = nullptr;
+    if(self->pulse_reconnecting) {
+        return;
+    }
+    self->pulse_disconnect_stream(bridge);
+    self->pulse_query_device(bridge);
+}
+
+bool JopaSession::pulse_streams_ready() {
+    // A stream waiting for its device to show up does not hold back the others
+    for(Bridge* bridge : bridges) {
+        if(!bridge->application && bridge->retry_event == nullptr && bridge->ready_time == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void JopaSession::add_bridge(Direction direction, std::string const& label, std::string const& device) {
+    Bridge* bridge = new Bridge;
+    bridge->session = this;
+    bridge->direction = direction;
+    bridge->label = label;
+    bridge->device = device;
+    // Nothing is connected to new ports
+    bridge->active = direction == Direction::playback;
+    switch(direction) {
+    case Direction::playback:
+        bridge->name = "playback";
+        bridge->title = "Playback";
+        break;
+    case Direction::record:
+        bridge->name = "record";
+        bridge->title = "Record";
+        break;
+    case Direction::monitor:
+        bridge->name = "monitor";
+        bridge->title = "Monitor";
+        break;
     }
-    // Deadlock
+    if(!label.empty()) {
+        bridge->name += " (" + label + ")";
+        bridge->title += " (" + label + ")";
+    }
+    bridge->names.publish(label, "", device);
+    bridges.push_back(bridge);
+}
+
+void JopaSession::run() {
+    // Everything runs on the JACK and PulseAudio threads, deadlock
     pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
     pthread_mutex_lock(&mutex);
     pthread_mutex_lock(&mutex);
@@ -245,531 +1549,2606 @@ void JopaSession::run() {
 }
 
 JopaSession::~JopaSession() {
-    if(pulse_monitor_stream != nullptr) {
-        pa_stream_disconnect(pulse_monitor_stream);
-        pa_stream_unref(pulse_monitor_stream);
-        pulse_monitor_stream = nullptr;
-    }
-    if(pulse_record_stream != nullptr) {
-        pa_stream_disconnect(pulse_record_stream);
-        pa_stream_unref(pulse_record_stream);
-        pulse_record_stream = nullptr;
-    }
-    if(pulse_playback_stream != nullptr) {
-        pa_stream_disconnect(pulse_playback_stream);
-        pa_stream_unref(pulse_playback_stream);
-        pulse_playback_stream = nullptr;
-    }
-    if(pulse_context != nullptr) {
-        pa_context_disconnect(pulse_context);
-        pa_context_unref(pulse_context);
-        pulse_context = nullptr;
+    // The worker thread registers ports and creates streams for application slots
+    if(worker_started) {
+        worker_quit.store(true);
+        sem_post(&worker_wakeup);
+        pthread_join(worker_thread, nullptr);
+        sem_destroy(&worker_wakeup);
+        worker_started = false;
     }
+    // The mainloop runs from init() on, stop it before touching the context
     if(pulse_mainloop != nullptr) {
         pa_threaded_mainloop_stop(pulse_mainloop);
+    }
+    pulse_disconnect();
+    if(pulse_mainloop != nullptr) {
         pa_threaded_mainloop_free(pulse_mainloop);
         pulse_mainloop = nullptr;
     }
-    for(unsigned ch = 0; ch < num_channels; ++ch) {
-        if(jack_monitor_ports[ch] != nullptr) {
-            jack_port_unregister(jack_client, jack_monitor_ports[ch]);
-            jack_monitor_ports[ch] = nullptr;
+    for(Bridge* bridge : bridges) {
+        for(unsigned ch = 0; ch < num_channels; ++ch) {
+            if(bridge->ports[ch] != nullptr) {
+                jack_port_unregister(jack_client, bridge->ports[ch]);
+                bridge->ports[ch] = nullptr;
+            }
+        }
+    }
+    if(jack_client != nullptr) {
+        jack_client_close(jack_client);
+        jack_client = nullptr;
+    }
+    if(stats_started) {
+        // Wakes up the blocking accept()
+        shutdown(stats_socket, SHUT_RDWR);
+        pthread_join(stats_thread, nullptr);
+        stats_started = false;
+    }
+    if(stats_socket >= 0) {
+        close(stats_socket);
+        unlink(stats_socket_path.c_str());
+        stats_socket = -1;
+    }
+    free_retired_ringbuffers(true);
+    for(Bridge* bridge : bridges) {
+        if(bridge->ringbuffer != nullptr) {
+            JopaRing::destroy(bridge->ringbuffer);
+        }
+        delete bridge;
+    }
+    bridges.clear();
+}
+
+void JopaSession::jack_on_shutdown(void* arg) {
+    std::exit(0);
+}
+
+int JopaSession::jack_on_process(jack_nframes_t nframes, void* arg) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(arg);
+
+    struct timespec process_start;
+    clock_gettime(CLOCK_MONOTONIC, &process_start);
+    for(Bridge* bridge : self->bridges) {
+        if(!bridge->attached.load(std::memory_order_acquire)) {
+            continue;
+        }
+        // Loaded once per cycle, see free_retired_ringbuffers
+        JopaRing* ringbuffer = bridge->ringbuffer.load(std::memory_order_acquire);
+        if(bridge->direction != Direction::playback && !bridge->active.load(std::memory_order_acquire)) {
+            // Nobody listens and the stream is corked. Whatever arrived before the
+            // cork took effect would be stale by the time a port gets connected.
+            ringbuffer->read_advance(ringbuffer->read_space());
+            if(!bridge->ports_silenced) {
+                // A port connected before the worker thread notices must not repeat old audio
+                for(unsigned ch = 0; ch < self->num_channels; ++ch) {
+                    std::memset(jack_port_get_buffer(bridge->ports[ch], nframes), 0, nframes * sizeof (jack_sample_t));
+                    bridge->conceal_frame[ch] = 0;
+                }
+                bridge->conceal_fade_in = true;
+                bridge->ports_silenced = true;
+                if(self->metering) {
+                    self->reset_levels(bridge);
+                }
+            }
+            continue;
+        }
+        bridge->ports_silenced = false;
+
+        jack_sample_t* jack_buffer[PA_CHANNELS_MAX];
+        for(unsigned ch = 0; ch < self->num_channels; ++ch) {
+            jack_buffer[ch] = (jack_sample_t*) jack_port_get_buffer(bridge->ports[ch], nframes);
+        }
+        size_t frame_size = self->num_channels * sizeof (pulse_sample_t);
+
+        size_t fill_bucket = ringbuffer->fill() * stats_fill_buckets / ringbuffer->frames();
+        bridge->fill_histogram[fill_bucket < stats_fill_buckets ? fill_bucket : stats_fill_buckets - 1].add(1);
+
+        // While PulseAudio reconnects, playback is dropped and record plays out
+        // what is left before fading to silence, neither counts as an xrun
+        bool online = bridge->online.load(std::memory_order_acquire);
+        if(bridge->direction == Direction::playback) {
+            // Silence is still copied until idle_suspend runs out, so the stream has played
+            // all of it when corked. The first period with sound is copied again at once.
+            bool silent = true;
+            if(self->metering) {
+                // The silence check comes out of the same pass
+                silent = self->meter_levels(bridge, jack_buffer, nframes) <= idle_threshold;
+            } else if(self->idle_suspend > 0) {
+                for(unsigned ch = 0; ch < self->num_channels && silent; ++ch) {
+                    silent = self->meter.peak(jack_buffer[ch], nframes) <= idle_threshold;
+                }
+            }
+            bool active = true;
+            if(self->idle_suspend > 0) {
+                bridge->silent_frames = silent ? bridge->silent_frames + nframes : 0;
+                active = bridge->silent_frames < self->idle_suspend * self->sample_rate;
+                if(active != bridge->active.load(std::memory_order_relaxed)) {
+                    bridge->active.store(active, std::memory_order_release);
+                    self->activity_changed.store(true);
+                    if(active) {
+                        // Resuming cannot wait for the worker thread to poll, sem_post does not block
+                        sem_post(&self->worker_wakeup);
+                    }
+                }
+            }
+
+            // Copy playback stream
+            if(!online || !active) {
+                // Dropped
+            } else {
+                size_t buffer_space = ringbuffer->write_space(nframes);
+                if(buffer_space >= nframes) {
+                    self->ringbuffer_write_interleaved(ringbuffer, jack_buffer, nframes);
+                } else {
+                    self->post_xrun(self->jack_xrun_events, xrun_overflow, bridge, buffer_space * frame_size, nframes * frame_size, jack_last_frame_time(self->jack_client));
+                }
+            }
+        } else {
+            // Copy record or monitor stream
+            size_t buffer_space = ringbuffer->read_space(nframes);
+            if(buffer_space >= nframes) {
+                self->ringbuffer_read_interleaved(ringbuffer, jack_buffer, nframes);
+                self->conceal_record(bridge, jack_buffer, nframes, nframes);
+            } else {
+                // Play what is there, then fade out into silence
+                jack_nframes_t available = buffer_space;
+                self->ringbuffer_read_interleaved(ringbuffer, jack_buffer, available);
+                self->conceal_record(bridge, jack_buffer, available, nframes);
+                if(online) {
+                    self->post_xrun(self->jack_xrun_events, xrun_underflow, bridge, buffer_space * frame_size, nframes * frame_size, jack_last_frame_time(self->jack_client));
+                }
+            }
+            if(self->metering) {
+                self->meter_levels(bridge, jack_buffer, nframes);
+            }
+        }
+    }
+
+    struct timespec process_end;
+    clock_gettime(CLOCK_MONOTONIC, &process_end);
+    uint64_t process_time = (uint64_t) (process_end.tv_sec - process_start.tv_sec) * 1000000 + (process_end.tv_nsec - process_start.tv_nsec) / 1000;
+    unsigned time_bucket = 0;
+    while(time_bucket < stats_time_buckets - 1 && process_time >= (uint64_t) 1 << time_bucket) {
+        ++time_bucket;
+    }
+    self->process_time_histogram[time_bucket].add(1);
+    if(process_time > self->process_time_max.get()) {
+        self->process_time_max.set(process_time);
+    }
+    self->jack_cycles.add(1);
+
+    return 0;
+}
+
+int JopaSession::jack_on_buffer_size(jack_nframes_t nframes, void* arg) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(arg);
+
+    // Map the new ringbuffers before taking the lock, the PulseAudio thread need not
+    // wait for that. An exception would end the process from inside JACK, so a bridge
+    // without a new ringbuffer keeps its old one.
+    std::vector<JopaRing*> ringbuffers;
+    for(Bridge* bridge : self->bridges) {
+        JopaRing* ringbuffer = self->ringbuffer_create(self->ringbuffer_frames(nframes));
+        if(ringbuffer == nullptr) {
+            std::fprintf(stderr, "Unable to resize JACK %s buffer, keeping the old one: %s\n", bridge->name.c_str(), std::strerror(errno));
+        }
+        ringbuffers.push_back(ringbuffer);
+    }
+
+    PulseThreadedMainloopLocker locker(self->pulse_mainloop);
+
+    // Reset PulseAudio buffer
+    self->jack_buffer_size = nframes;
+    for(Bridge* bridge : self->bridges) {
+        if(pulse_is_stream_ready(bridge->stream)) {
+            pa_buffer_attr buffer_attr = self->pulse_calc_buffer_attr(bridge);
+            if(!pulse_check_operation(pa_stream_set_buffer_attr(bridge->stream, &buffer_attr, nullptr, nullptr))) {
+                self->pulse_fail(("Unable to reset PulseAudio " + bridge->name + " buffer").c_str());
+            }
+        }
+    }
+
+    // Replace the ringbuffers, carrying over the queued samples so the period change is seamless.
+    // The PulseAudio thread is held off by the mainloop lock, the JACK process thread picks up
+    // the new ringbuffer on its next cycle.
+    for(size_t index = 0; index < self->bridges.size(); ++index) {
+        Bridge* bridge = self->bridges[index];
+        JopaRing* ringbuffer = ringbuffers[index];
+        if(ringbuffer != nullptr) {
+            JopaRing* old_ringbuffer = bridge->ringbuffer.load();
+            // Leave room for one period, so the next cycle does not overflow
+            self->ringbuffer_transfer(old_ringbuffer, ringbuffer, self->ringbuffer_frames(nframes) - nframes);
+            bridge->ringbuffer.store(ringbuffer, std::memory_order_release);
+            RetiredRingbuffer retired = { old_ringbuffer, self->jack_cycles.get() };
+            if(!self->retired_ringbuffers.push(retired)) {
+                // Should not happen unless the buffer size changes many times within 100 ms
+                std::fprintf(stderr, "Too many buffer size changes, leaking a JACK %s buffer\n", bridge->name.c_str());
+            }
+        }
+        bridge->drift.reset();
+        bridge->jitter.clamp(self->jitter_min_target(nframes), self->jitter_max_target(nframes));
+        bridge->target_fill.set(bridge->jitter.target);
+        self->estimate_latency(bridge);
+    }
+
+    std::fprintf(stderr, "JACK buffer size is %u samples (%.2lf ms).\n", nframes, 1000.0 * nframes / self->sample_rate);
+    uint32_t min_target = self->jitter_min_target(nframes);
+    uint32_t max_target = self->jitter_max_target(nframes);
+    std::fprintf(stderr, "JOPA buffer size is %u to %u samples (%.2lf to %.2lf ms).\n", min_target, max_target, 1000.0 * min_target / self->sample_rate, 1000.0 * max_target / self->sample_rate);
+    std::fprintf(stderr, "PulseAudio buffer size is %u samples (%.2lf ms).\n", nframes, 1000.0 * nframes / self->sample_rate);
+
+    return 0;
+}
+
+int JopaSession::jack_on_sample_rate(jack_nframes_t nframes, void* arg) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(arg);
+    PulseThreadedMainloopLocker locker(self->pulse_mainloop);
+
+    // Reset PulseAudio streams
+    self->sample_rate = nframes;
+    for(Bridge* bridge : self->bridges) {
+        bridge->drift.reset();
+        if(pulse_is_stream_ready(bridge->stream)) {
+            if(!pulse_check_operation(pa_stream_update_sample_rate(bridge->stream, nframes, nullptr, nullptr))) {
+                self->pulse_fail(("Unable to reset PulseAudio " + bridge->name + " sample rate").c_str());
+            }
+        }
+    }
+
+    std::fprintf(stderr, "Sample rate is %u Hz.\n", nframes);
+
+    return 0;
+}
+
+void JopaSession::jack_on_port_connect(jack_port_id_t a, jack_port_id_t b, int connect, void* arg) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(arg);
+
+    jack_port_t* port_a = jack_port_by_id(self->jack_client, a);
+    jack_port_t* port_b = jack_port_by_id(self->jack_client, b);
+
+    char const* port_name_a = jack_port_name(port_a);
+    char const* port_name_b = jack_port_name(port_b);
+
+    char const* port_short_name_a = jack_port_short_name(port_a);
+    char const* port_short_name_b = jack_port_short_name(port_b);
+
+    for(Bridge* bridge : self->bridges) {
+        // Search for system:capture ports
+        if(bridge->direction == Direction::record && std::strncmp(port_name_a, "system:", 7) == 0) {
+            for(unsigned ch = 0; ch < self->num_channels; ++ch) {
+                if(std::strcmp(jack_port_short_name(bridge->ports[ch]), port_short_name_a) == 0) {
+                    self->jack_schedule_connect(jack_port_name(bridge->ports[ch]), port_name_b, connect);
+                    break;
+                }
+            }
+        }
+
+        // Search for system:playback ports
+        if(bridge->direction == Direction::playback && std::strncmp(port_name_b, "system:", 7) == 0) {
+            for(unsigned ch = 0; ch < self->num_channels; ++ch) {
+                if(std::strcmp(jack_port_short_name(bridge->ports[ch]), port_short_name_b) == 0) {
+                    self->jack_schedule_connect(port_name_a, jack_port_name(bridge->ports[ch]), connect);
+                    break;
+                }
+            }
+        }
+    }
+
+    self->activity_changed.store(true);
+    sem_post(&self->worker_wakeup);
+
+    if(connect) {
+        std::fprintf(stderr, "%s =====> %s\n", port_name_a, port_name_b);
+    } else {
+        std::fprintf(stderr, "%s ==X==> %s\n", port_name_a, port_name_b);
+    }
+
+}
+
+int JopaSession::jack_on_xrun(void* arg) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(arg);
+    self->jack_xruns.add(1);
+    return 0;
+}
+
+void JopaSession::jack_on_latency(jack_latency_callback_mode_t mode, void* arg) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(arg);
+
+    // Playback ports delay audio on its way out of the graph, capture and monitor ports on its way in
+    for(Bridge* bridge : self->bridges) {
+        if((bridge->direction == Direction::playback) != (mode == JackPlaybackLatency) || !bridge->attached.load(std::memory_order_acquire)) {
+            continue;
+        }
+        jack_latency_range_t range;
+        range.min = range.max = (jack_nframes_t) bridge->reported_latency.get();
+        for(unsigned ch = 0; ch < self->num_channels; ++ch) {
+            jack_port_set_latency_range(bridge->ports[ch], mode, &range);
+        }
+    }
+}
+
+void JopaSession::jack_on_error(char const* reason) {
+    std::fprintf(stderr, "JACK error: %s\n", reason);
+}
+
+bool JopaSession::jack_register_ports(Bridge* bridge) {
+    char const* port_type;
+    unsigned long port_flags;
+    switch(bridge->direction) {
+    case Direction::playback:
+        port_type = "playback_";
+        port_flags = JackPortIsInput | JackPortIsTerminal;
+        break;
+    case Direction::record:
+        port_type = "capture_";
+        port_flags = JackPortIsOutput | JackPortIsTerminal;
+        break;
+    default:
+        port_type = "monitor_";
+        port_flags = JackPortIsOutput;
+        break;
+    }
+    for(unsigned ch = 0; ch < num_channels; ++ch) {
+        std::string port_name = bridge->label.empty() ? "" : bridge->label + "_";
+        port_name += port_type;
+        port_name += std::to_string(ch + 1);
+        bridge->ports[ch] = jack_port_register(jack_client, port_name.c_str(), JACK_DEFAULT_AUDIO_TYPE, port_flags, 0);
+        if(bridge->ports[ch] == nullptr) {
+            std::fprintf(stderr, "Unable to create JACK port: %s\n", port_name.c_str());
+            for(unsigned i = 0; i < ch; ++i) {
+                jack_port_unregister(jack_client, bridge->ports[i]);
+                bridge->ports[i] = nullptr;
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+void JopaSession::pulse_on_context_state(pa_context* c, void* userdata) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(userdata);
+
+    switch(pa_context_get_state(c)) {
+    case PA_CONTEXT_READY:
+        break;
+    case PA_CONTEXT_FAILED:
+        self->pulse_fail("Unable to connect to the PulseAudio server");
+        return;
+    case PA_CONTEXT_TERMINATED:
+        std::exit(0);
+        return;
+    default:
+        return;
+    }
+
+    if(self->jack_active) {
+        self->pulse_create_streams();
+    } else if(!pulse_check_operation(pa_context_get_sink_info_by_name(c, "@DEFAULT_SINK@", pulse_on_get_default_sink_info, self))) {
+        self->pulse_fail("Unable to query PulseAudio for sink information");
+    }
+}
+
+void JopaSession::pulse_create_streams() {
+    for(Bridge* bridge : bridges) {
+        if(!bridge->application && !pulse_query_device(bridge)) {
+            return;
+        }
+    }
+
+    // Answered after the sink info above, so the sinks are known by then
+    if(app_ports) {
+        pa_context_set_subscribe_callback(pulse_context, pulse_on_subscribe, this);
+        if(!pulse_check_operation(pa_context_subscribe(pulse_context, PA_SUBSCRIPTION_MASK_SINK_INPUT, nullptr, nullptr))
+            || !pulse_check_operation(pa_context_get_sink_input_info_list(pulse_context, pulse_on_get_sink_input_info, this))) {
+            pulse_fail("Unable to subscribe to PulseAudio sink inputs");
+        }
+    }
+}
+
+bool JopaSession::pulse_query_device(Bridge* bridge) {
+    // Streams are created once the native sample format of their device is known
+    if(bridge->direction == Direction::record) {
+        char const* device = bridge->device.empty() ? "@DEFAULT_SOURCE@" : bridge->device.c_str();
+        if(!pulse_check_operation(pa_context_get_source_info_by_name(pulse_context, device, pulse_on_get_source_info, bridge))) {
+            pulse_fail("Unable to query PulseAudio for source information");
+            return false;
+        }
+    } else {
+        char const* device = bridge->device.empty() ? "@DEFAULT_SINK@" : bridge->device.c_str();
+        if(!pulse_check_operation(pa_context_get_sink_info_by_name(pulse_context, device, pulse_on_get_sink_info, bridge))) {
+            pulse_fail("Unable to query PulseAudio for sink information");
+            return false;
+        }
+    }
+    return true;
+}
+
+void JopaSession::pulse_connect_stream(Bridge* bridge, pa_sample_format_t native_format, char const* device) {
+    bridge->sample_format = pulse_choose_format(native_format);
+    if(bridge->sample_format != PA_SAMPLE_FLOAT32NE) {
+        bridge->conceal_buffer.resize(conceal_buffer_frames * num_channels);
+        bridge->converter = JopaConverter::select(bridge->sample_format);
+        JopaConverter::seed(&bridge->dither, (uint32_t) (std::find(bridges.begin(), bridges.end(), bridge) - bridges.begin()));
+    }
+    std::fprintf(stderr, "%s stream uses %s samples%s.\n", bridge->title.c_str(), pa_sample_format_to_string(bridge->sample_format),
+        bridge->sample_format == PA_SAMPLE_S16NE && use_dither ? " with dither" : "");
+
+    // Create stream
+    pa_sample_spec sample_spec = pulse_calc_sample_spec(bridge->sample_format);
+    std::string stream_name = "JACK " + bridge->name;
+    bridge->stream = pa_stream_new(pulse_context, stream_name.c_str(), &sample_spec, &channel_map);
+    if(bridge->stream == nullptr) {
+        pulse_fail_stream(bridge, ("Unable to create a PulseAudio " + bridge->name + " stream").c_str());
+        return;
+    }
+
+    // A move operation resets the stream's buffer attributes
+    // Use a callback to detect the change
+    pa_stream_set_moved_callback(bridge->stream, pulse_on_stream_moved, bridge);
+    pa_stream_set_state_callback(bridge->stream, pulse_on_stream_state, bridge);
+    // Application slots record a single sink input from the monitor source, ahead of the sink mix
+    if(bridge->application && pa_stream_set_monitor_stream(bridge->stream, bridge->sink_input) < 0) {
+        pulse_fail_stream(bridge, ("Unable to create a PulseAudio " + bridge->name + " stream").c_str());
+        return;
+    }
+
+    pa_buffer_attr buffer_attr = pulse_calc_buffer_attr(bridge);
+    estimate_latency(bridge);
+    pa_stream_flags_t stream_flags = (pa_stream_flags_t) (PA_STREAM_VARIABLE_RATE | PA_STREAM_ADJUST_LATENCY | PA_STREAM_AUTO_TIMING_UPDATE);
+    // Stays corked until a port is connected or JACK plays sound, see pulse_apply_activity
+    bridge->corked = !bridge->active.load();
+    if(bridge->corked) {
+        stream_flags = (pa_stream_flags_t) (stream_flags | PA_STREAM_START_CORKED);
+    }
+    if(bridge->direction == Direction::playback) {
+        pa_stream_set_write_callback(bridge->stream, pulse_on_playback_writable, bridge);
+        if(pa_stream_connect_playback(bridge->stream, device, &buffer_attr, stream_flags, nullptr, nullptr) < 0) {
+            pulse_fail_stream(bridge, ("Unable to connect to PulseAudio " + bridge->name + " stream").c_str());
+        }
+    } else {
+        pa_stream_set_read_callback(bridge->stream, pulse_on_record_readable, bridge);
+        if(pa_stream_connect_record(bridge->stream, device, &buffer_attr, stream_flags) < 0) {
+            pulse_fail_stream(bridge, ("Unable to connect to PulseAudio " + bridge->name + " stream").c_str());
+        }
+    }
+}
+
+void JopaSession::pulse_on_playback_writable(pa_stream* p, size_t nbytes, void* userdata) {
+    Bridge* bridge = reinterpret_cast<Bridge*>(userdata);
+    JopaSession* self = bridge->session;
+    // The JACK process thread stops filling the ringbuffer while corked
+    if(self->pulse_reconnecting || bridge->corked) {
+        return;
+    }
+
+    // Play whatever the ringbuffer has and conceal only the rest
+    size_t frame_size = self->num_channels * sizeof (pulse_sample_t);
+    size_t nframes = nbytes / self->pulse_frame_size(bridge);
+    size_t nframes_readable = bridge->ringbuffer.load()->read_space(nframes);
+    size_t nframes_played = std::min(nframes_readable, nframes);
+    if(nframes_played != 0) {
+        self->pulse_resume_playback(bridge, nframes_played);
+        self->pulse_write_playback(bridge, nframes_played);
+    }
+    // Gone idle, the JACK process thread has stopped filling the ringbuffer and the worker
+    // thread corks the stream on its next poll. Running dry until then is no underflow,
+    // it must neither count nor grow the jitter target.
+    bool idle = !bridge->active.load(std::memory_order_acquire);
+    if(nframes_played < nframes) {
+        if(!idle) {
+            self->post_xrun(self->pulse_xrun_events, xrun_underflow, bridge, nframes_readable * frame_size, nframes * frame_size, jack_frame_time(self->jack_client));
+        }
+        if(!self->pulse_write_concealed(bridge, nframes - nframes_played)) {
+            return;
+        }
+    }
+
+    if(!idle) {
+        self->pulse_update_drift(bridge);
+    }
+}
+
+bool JopaSession::pulse_write_concealed(Bridge* bridge, size_t nframes) {
+    size_t pulse_frame_size = this->pulse_frame_size(bridge);
+    while(nframes != 0) {
+        void* data;
+        size_t nbytes_writable = nframes * pulse_frame_size;
+        if(pa_stream_begin_write(bridge->stream, &data, &nbytes_writable) < 0) {
+            pulse_fail("Unable to write to PulseAudio playback buffer");
+            return false;
+        }
+        size_t nframes_concealed = std::min(nframes, nbytes_writable / pulse_frame_size);
+        if(bridge->sample_format != PA_SAMPLE_FLOAT32NE) {
+            // Nothing is allocated here, this runs on the real-time PulseAudio thread
+            nframes_concealed = std::min<size_t>(nframes_concealed, conceal_buffer_frames);
+            pulse_conceal_playback(bridge, bridge->conceal_buffer.data(), nframes_concealed);
+            bridge->converter.encode(data, bridge->conceal_buffer.data(), nframes_concealed * num_channels, &bridge->dither, use_dither ? 1.0f : 0.0f);
+        } else {
+            pulse_conceal_playback(bridge, (pulse_sample_t*) data, nframes_concealed);
+        }
+        if(pa_stream_write(bridge->stream, data, nframes_concealed * pulse_frame_size, nullptr, 0, PA_SEEK_RELATIVE) < 0) {
+            pulse_fail("Unable to write to PulseAudio playback buffer");
+            return false;
+        }
+        nframes -= nframes_concealed;
+    }
+    return true;
+}
+
+void JopaSession::pulse_write_playback(Bridge* bridge, size_t nframes) {
+    JopaRing* ringbuffer = bridge->ringbuffer;
+    size_t pulse_frame_size = this->pulse_frame_size(bridge);
+    float dither_scale = use_dither ? 1.0f : 0.0f;
+    while(nframes != 0) {
+        void* data;
+        size_t nbytes_writable = nframes * pulse_frame_size;
+        if(pa_stream_begin_write(bridge->stream, &data, &nbytes_writable) < 0) {
+            pulse_fail("Unable to write to PulseAudio playback buffer");
+            return;
+        }
+        size_t nframes_written = std::min(nframes, nbytes_writable / pulse_frame_size);
+
+        // The one copy out of the ringbuffer, straight into PulseAudio's memory pool. The
+        // public API cannot take memory it does not own without a copy, on local connections
+        // pa_stream_write_ext_free copies into that same pool.
+        if(bridge->sample_format == PA_SAMPLE_FLOAT32NE) {
+            std::memcpy(data, ringbuffer->read_pointer(), nframes_written * pulse_frame_size);
+        } else {
+            bridge->converter.encode(data, ringbuffer->read_pointer(), nframes_written * num_channels, &bridge->dither, dither_scale);
+        }
+        ringbuffer->read_advance(nframes_written);
+
+        if(pa_stream_write(bridge->stream, data, nframes_written * pulse_frame_size, nullptr, 0, PA_SEEK_RELATIVE) < 0) {
+            pulse_fail("Unable to write to PulseAudio playback buffer");
+            return;
+        }
+        nframes -= nframes_written;
+    }
+}
+
+void JopaSession::pulse_read_converted(Bridge* bridge, void const* data, size_t nframes) {
+    JopaRing* ringbuffer = bridge->ringbuffer;
+    bridge->converter.decode(ringbuffer->write_pointer(), data, nframes * num_channels);
+    ringbuffer->write_advance(nframes);
+}
+
+void JopaSession::pulse_resume_playback(Bridge* bridge, size_t nframes) {
+    // Works on the ringbuffer in place, before it is copied out
+    pulse_sample_t* data = bridge->ringbuffer.load()->read_pointer();
+    if(bridge->conceal_fade_in) {
+        size_t fade_frames = std::min<size_t>(nframes, conceal_fade_frames);
+        for(size_t i = 0; i < fade_frames; ++i) {
+            pulse_sample_t gain = (pulse_sample_t) (i + 1) / (pulse_sample_t) (conceal_fade_frames + 1);
+            for(unsigned ch = 0; ch < num_channels; ++ch) {
+                data[i * num_channels + ch] *= gain;
+            }
+        }
+        bridge->conceal_fade_in = false;
+    }
+    for(unsigned ch = 0; ch < num_channels; ++ch) {
+        bridge->conceal_frame[ch] = data[(nframes - 1) * num_channels + ch];
+    }
+}
+
+void JopaSession::pulse_conceal_playback(Bridge* bridge, pulse_sample_t* data, size_t nframes) {
+    // Ramp the last played frame down to silence, so the gap does not click
+    for(size_t i = 0; i < nframes; ++i) {
+        pulse_sample_t gain = i < conceal_fade_frames ? 1 - (pulse_sample_t) (i + 1) / (pulse_sample_t) (conceal_fade_frames + 1) : 0;
+        for(unsigned ch = 0; ch < num_channels; ++ch) {
+            data[i * num_channels + ch] = bridge->conceal_frame[ch] * gain;
+        }
+    }
+    if(nframes != 0) {
+        std::fill_n(bridge->conceal_frame, num_channels, 0);
+        bridge->conceal_fade_in = true;
+    }
+}
+
+void JopaSession::pulse_on_record_readable(pa_stream* p, size_t, void* userdata) {
+    Bridge* bridge = reinterpret_cast<Bridge*>(userdata);
+    JopaSession* self = bridge->session;
+    // A failed stream waiting for its retry stays offline, see pulse_fail_stream
+    if(self->pulse_reconnecting || bridge->retry_event != nullptr) {
+        return;
+    }
+
+    while(pa_stream_readable_size(p) > 0) {
+        pulse_sample_t const* data;
+        size_t nbytes_readable;
+        if(pa_stream_peek(p, (void const**) &data, &nbytes_readable) < 0) {
+            self->pulse_fail(("Unable to read from PulseAudio " + bridge->name + " buffer").c_str());
+            return;
+        }
+        if(data != nullptr) {
+            // Integer streams are converted to float on the way into the ringbuffer
+            size_t pulse_frame_size = self->pulse_frame_size(bridge);
+            size_t nframes = nbytes_readable / pulse_frame_size;
+            // Catching up with the other streams drops audio here, see align_capture.
+            // So does audio still in flight when the stream was corked.
+            size_t nframes_skipped = bridge->corked ? nframes : std::min(bridge->align_skip, nframes);
+            bridge->align_skip -= std::min(bridge->align_skip, nframes_skipped);
+            nframes -= nframes_skipped;
+            data = (pulse_sample_t const*) ((char const*) data + nframes_skipped * pulse_frame_size);
+            JopaRing* ringbuffer = bridge->ringbuffer;
+            size_t frame_size = self->num_channels * sizeof (pulse_sample_t);
+            size_t nframes_writable = ringbuffer->write_space(nframes);
+            if(nframes_writable < nframes) {
+                self->post_xrun(self->pulse_xrun_events, xrun_overflow, bridge, nframes_writable * frame_size, nframes * frame_size, jack_frame_time(self->jack_client));
+            } else if(bridge->sample_format != PA_SAMPLE_FLOAT32NE) {
+                self->pulse_read_converted(bridge, data, nframes);
+            } else {
+                std::memcpy(ringbuffer->write_pointer(), data, nframes * frame_size);
+                ringbuffer->write_advance(nframes);
+            }
+            if(nframes != 0 && !bridge->online.load(std::memory_order_relaxed)) {
+                // Resumed after being corked, see pulse_apply_activity
+                bridge->online.store(true, std::memory_order_release);
+            }
+            if(pa_stream_drop(p) < 0) {
+                self->pulse_fail(("Unable to read from PulseAudio " + bridge->name + " buffer").c_str());
+                return;
+            }
+        } else if(nbytes_readable != 0) {
+            self->post_xrun(self->pulse_xrun_events, xrun_hole, bridge, 0, nbytes_readable, jack_frame_time(self->jack_client));
+            if(pa_stream_drop(p) < 0) {
+                self->pulse_fail(("Unable to read from PulseAudio " + bridge->name + " buffer").c_str());
+                return;
+            }
+        }
+    }
+    if(!bridge->corked) {
+        self->pulse_update_drift(bridge);
+    }
+}
+
+void JopaSession::pulse_on_stream_moved(pa_stream* p, void* userdata) {
+    Bridge* bridge = reinterpret_cast<Bridge*>(userdata);
+    JopaSession* self = bridge->session;
+
+    // Reset buffer attributes
+    bridge->drift.reset();
+    pa_buffer_attr buffer_attr = self->pulse_calc_buffer_attr(bridge);
+    if(pulse_is_stream_ready(p)) {
+        if(!pulse_check_operation(pa_stream_set_buffer_attr(p, &buffer_attr, nullptr, nullptr))) {
+            self->pulse_fail(("Unable to reset PulseAudio " + bridge->name + " buffer").c_str());
+        }
+    }
+}
+
+void JopaSession::pulse_on_stream_state(pa_stream* p, void* userdata) {
+    Bridge* bridge = reinterpret_cast<Bridge*>(userdata);
+    JopaSession* self = bridge->session;
+
+    switch(pa_stream_get_state(p)) {
+    case PA_STREAM_READY:
+        bridge->drift.reset();
+        self->capture_reset(bridge);
+        // Playback queued up before an outage is stale by now. The JACK process
+        // thread does not write while the bridge is offline.
+        if(bridge->direction == Direction::playback) {
+            JopaRing* ringbuffer = bridge->ringbuffer;
+            ringbuffer->read_advance(ringbuffer->read_space());
+        }
+        bridge->online.store(true, std::memory_order_release);
+        bridge->ready_time = pa_rtclock_now();
+        if(self->pulse_ready_time == 0 && self->pulse_streams_ready()) {
+            self->pulse_ready_time = bridge->ready_time;
+        }
+        // Ports may have been connected or disconnected while the stream was being created
+        self->pulse_apply_activity(bridge);
+        break;
+    case PA_STREAM_FAILED:
+        self->pulse_fail_stream(bridge, ("PulseAudio " + bridge->name + " stream failed").c_str());
+        break;
+    default:
+        break;
+    }
+}
+
+void JopaSession::pulse_on_get_sink_info(pa_context* c, pa_sink_info const* i, int eol, void* userdata) {
+    Bridge* bridge = reinterpret_cast<Bridge*>(userdata);
+    JopaSession* self = bridge->session;
+
+    if(eol < 0) {
+        self->pulse_fail_stream(bridge, ("Unable to get PulseAudio " + bridge->name + " sink info").c_str());
+        return;
+    }
+    if(i == nullptr) {
+        return;
+    }
+
+    // Playback follows the default sink if none was named, monitors always need the source name
+    bridge->sink_index = i->index;
+    if(bridge->direction == Direction::playback) {
+        self->pulse_connect_stream(bridge, i->sample_spec.format, bridge->device.empty() ? nullptr : bridge->device.c_str());
+    } else {
+        bridge->monitor_source = i->monitor_source_name;
+        self->pulse_connect_stream(bridge, i->sample_spec.format, i->monitor_source_name);
+    }
+}
+
+void JopaSession::pulse_on_get_source_info(pa_context* c, pa_source_info const* i, int eol, void* userdata) {
+    Bridge* bridge = reinterpret_cast<Bridge*>(userdata);
+    JopaSession* self = bridge->session;
+
+    if(eol < 0) {
+        self->pulse_fail_stream(bridge, ("Unable to get PulseAudio " + bridge->name + " source info").c_str());
+        return;
+    }
+    if(i == nullptr) {
+        return;
+    }
+
+    self->pulse_connect_stream(bridge, i->sample_spec.format, bridge->device.empty() ? nullptr : bridge->device.c_str());
+}
+
+void JopaSession::pulse_on_get_default_sink_info(pa_context*, pa_sink_info const* i, int, void* userdata) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(userdata);
+
+    // Without a default sink, a JACK server started by jopa keeps its defaults
+    if(i == nullptr) {
+        return;
+    }
+    self->default_sink_rate = i->sample_spec.rate;
+    self->default_sink_latency = i->configured_latency != 0 ? i->configured_latency : i->latency;
+    self->default_sink_known = true;
+}
+
+void JopaSession::ringbuffer_write_interleaved(JopaRing* ringbuffer, jack_sample_t* const* jack_buffer, jack_nframes_t nframes) const {
+    // Contiguous across the wraparound point, see JopaRing
+    sample_kernels.interleave(ringbuffer->write_pointer(), jack_buffer, num_channels, 0, nframes);
+    ringbuffer->write_advance(nframes);
+}
+
+void JopaSession::conceal_record(Bridge* bridge, jack_sample_t* const* jack_buffer, jack_nframes_t available, jack_nframes_t nframes) const {
+    for(unsigned ch = 0; ch < num_channels; ++ch) {
+        jack_sample_t* buffer = jack_buffer[ch];
+        // Fade in after a gap
+        if(bridge->conceal_fade_in) {
+            jack_nframes_t fade_frames = available < conceal_fade_frames ? available : conceal_fade_frames;
+            for(jack_nframes_t i = 0; i < fade_frames; ++i) {
+                buffer[i] *= (jack_sample_t) (i + 1) / (jack_sample_t) (conceal_fade_frames + 1);
+            }
+        }
+        // Ramp the last frame down to silence over the missing part
+        jack_sample_t last = available != 0 ? buffer[available - 1] : bridge->conceal_frame[ch];
+        for(jack_nframes_t i = available; i < nframes; ++i) {
+            jack_nframes_t fade_index = i - available;
+            buffer[i] = fade_index < conceal_fade_frames ? last * (1 - (jack_sample_t) (fade_index + 1) / (jack_sample_t) (conceal_fade_frames + 1)) : 0;
+        }
+        bridge->conceal_frame[ch] = buffer[nframes - 1];
+    }
+    bridge->conceal_fade_in = available != nframes;
+}
+
+float JopaSession::meter_levels(Bridge* bridge, jack_sample_t* const* jack_buffer, jack_nframes_t nframes) const {
+    // Returns the peak of the loudest channel in this period. A pass of its own rather
+    // than part of the sample kernels: record ports are metered after the concealment,
+    // and playback also while the copy is skipped. The buffers are still in L1 by then.
+    float loudest = 0;
+    for(unsigned ch = 0; ch < num_channels; ++ch) {
+        JopaMeter::Level level = meter.level(jack_buffer[ch], nframes);
+        bridge->level_peak[ch] = std::max(bridge->level_peak[ch], level.peak);
+        bridge->level_energy[ch] += level.energy;
+        loudest = std::max(loudest, level.peak);
+    }
+    bridge->level_frames += nframes;
+    if(bridge->level_frames >= level_window * sample_rate) {
+        float rms[PA_CHANNELS_MAX];
+        for(unsigned ch = 0; ch < num_channels; ++ch) {
+            rms[ch] = (float) std::sqrt(bridge->level_energy[ch] / bridge->level_frames);
+        }
+        bridge->levels.publish(bridge->level_peak, rms, num_channels);
+        std::fill_n(bridge->level_peak, num_channels, 0.0f);
+        std::fill_n(bridge->level_energy, num_channels, 0.0);
+        bridge->level_frames = 0;
+    }
+    return loudest;
+}
+
+void JopaSession::reset_levels(Bridge* bridge) const {
+    // Silenced ports read as silence right away, not after the next window
+    std::fill_n(bridge->level_peak, num_channels, 0.0f);
+    std::fill_n(bridge->level_energy, num_channels, 0.0);
+    bridge->level_frames = 0;
+    bridge->levels.publish(bridge->level_peak, bridge->level_peak, num_channels);
+}
+
+void JopaSession::ringbuffer_transfer(JopaRing* from, JopaRing* to, size_t max_frames) const {
+    size_t nframes = from->read_space();
+    size_t max_writable = to->write_space();
+    if(max_frames > max_writable) {
+        max_frames = max_writable;
+    }
+    std::vector<pulse_sample_t> samples(from->read_pointer(), from->read_pointer() + nframes * num_channels);
+    from->read_advance(nframes);
+
+    // Keep the newest samples, crossfading from the dropped ones to hide the jump
+    size_t dropped = nframes > max_frames ? nframes - max_frames : 0;
+    size_t kept = nframes - dropped;
+    size_t crossfade = std::min<size_t>(std::min(dropped, kept), ringbuffer_crossfade_frames);
+    pulse_sample_t* kept_samples = samples.data() + dropped * num_channels;
+    for(size_t i = 0; i < crossfade; ++i) {
+        float gain = (float) (i + 1) / (float) (crossfade + 1);
+        for(unsigned ch = 0; ch < num_channels; ++ch) {
+            kept_samples[i * num_channels + ch] = samples[i * num_channels + ch] * (1.0f - gain) + kept_samples[i * num_channels + ch] * gain;
+        }
+    }
+    std::copy_n(kept_samples, kept * num_channels, to->write_pointer());
+    to->write_advance(kept);
+}
+
+void JopaSession::ringbuffer_read_interleaved(JopaRing* ringbuffer, jack_sample_t* const* jack_buffer, jack_nframes_t nframes) const {
+    sample_kernels.deinterleave(jack_buffer, ringbuffer->read_pointer(), num_channels, 0, nframes);
+    ringbuffer->read_advance(nframes);
+}
+
+void JopaSession::jack_schedule_connect(char const* port_name_a, char const* port_name_b, bool connect) {
+    JackConnectOperation operation;
+    if(std::strlen(port_name_a) >= jack_port_name_max || std::strlen(port_name_b) >= jack_port_name_max) {
+        std::fprintf(stderr, "Port name too long, not mirroring connection: %s, %s\n", port_name_a, port_name_b);
+        return;
+    }
+    std::strcpy(operation.port_name_a, port_name_a);
+    std::strcpy(operation.port_name_b, port_name_b);
+    operation.connect = connect;
+    if(!jack_connect_operations.push(operation)) {
+        std::fprintf(stderr, "Too many pending connections, not mirroring: %s, %s\n", port_name_a, port_name_b);
+        return;
+    }
+    sem_post(&worker_wakeup);
+}
+
+void* JopaSession::worker_main(void* arg) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(arg);
+
+    while(!self->worker_quit.load()) {
+        // Woken up early for connections, xrun events are picked up by polling
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_nsec -= 1000000000;
+            ++deadline.tv_sec;
+        }
+        sem_timedwait(&self->worker_wakeup, &deadline);
+
+        AppOperation app_operation;
+        while(self->app_operations.pop(app_operation)) {
+            if(app_operation.attach) {
+                self->app_attach(app_operation.bridge);
+            } else {
+                self->app_detach(app_operation.bridge);
+            }
+        }
+
+        JackConnectOperation operation;
+        while(self->jack_connect_operations.pop(operation)) {
+            if(operation.connect) {
+                jack_connect(self->jack_client, operation.port_name_a, operation.port_name_b);
+            } else {
+                jack_disconnect(self->jack_client, operation.port_name_a, operation.port_name_b);
+            }
+        }
+
+        if(self->activity_changed.exchange(false)) {
+            self->update_activity();
+        }
+        self->drain_xrun_events();
+        self->report_latency();
+        self->free_retired_ringbuffers(false);
+    }
+    return nullptr;
+}
+
+void JopaSession::update_activity() {
+    {
+        // Ports exist once JACK is active, try again on the next round until then
+        PulseThreadedMainloopLocker locker(pulse_mainloop);
+        if(!jack_active) {
+            activity_changed.store(true);
+            return;
+        }
+    }
+    for(Bridge* bridge : bridges) {
+        if(bridge->direction == Direction::playback) {
+            // The JACK process thread decides, see jack_on_process
+            PulseThreadedMainloopLocker locker(pulse_mainloop);
+            pulse_apply_activity(bridge);
+            continue;
+        }
+        // Application slots change on this thread only, see app_attach
+        if(!bridge->attached.load()) {
+            continue;
+        }
+        // jack_port_connected only looks at the graph in shared memory
+        bool connected = false;
+        for(unsigned ch = 0; ch < num_channels && !connected; ++ch) {
+            connected = jack_port_connected(bridge->ports[ch]) > 0;
+        }
+        if(connected == bridge->active.load()) {
+            continue;
+        }
+        PulseThreadedMainloopLocker locker(pulse_mainloop);
+        if(connected) {
+            // Underflows are expected until the first audio after the uncork arrives
+            bridge->online.store(false, std::memory_order_release);
+        }
+        bridge->active.store(connected, std::memory_order_release);
+        pulse_apply_activity(bridge);
+    }
+}
+
+void JopaSession::pulse_apply_activity(Bridge* bridge) {
+    bool cork = !bridge->active.load();
+    if(cork == bridge->corked || !pulse_is_stream_ready(bridge->stream)) {
+        return;
+    }
+    // The silence queued up on the server before the stream was corked would delay the
+    // sound that woke it, on top of what JACK writes while the uncork is on its way
+    if(!cork && bridge->direction == Direction::playback && !pulse_check_operation(pa_stream_flush(bridge->stream, nullptr, nullptr))) {
+        pulse_fail(("Unable to flush PulseAudio " + bridge->name + " stream").c_str());
+        return;
+    }
+    if(!pulse_check_operation(pa_stream_cork(bridge->stream, cork, nullptr, nullptr))) {
+        pulse_fail(("Unable to " + std::string(cork ? "cork" : "uncork") + " PulseAudio " + bridge->name + " stream").c_str());
+        return;
+    }
+    bridge->corked = cork;
+    if(!cork) {
+        // The fill level and device latency start over, as for a new stream
+        bridge->drift.reset();
+        capture_reset(bridge);
+    }
+    if(!cork && bridge->direction == Direction::playback) {
+        // Requests left unanswered while corked are served right away, the server asks
+        // for the flushed part anew
+        size_t nbytes = pa_stream_writable_size(bridge->stream);
+        if(nbytes != 0 && nbytes != (size_t) -1) {
+            pulse_on_playback_writable(bridge->stream, nbytes, bridge);
+        }
+    }
+    if(cork) {
+        std::fprintf(stderr, "%s stream paused, %s.\n", bridge->title.c_str(), bridge->direction == Direction::playback ? "JACK is silent" : "no ports are connected");
+    } else {
+        std::fprintf(stderr, "%s stream resumed.\n", bridge->title.c_str());
+    }
+}
+
+void JopaSession::capture_reset(Bridge* bridge) {
+    // Starts out without any alignment delay, see align_capture
+    bridge->align_frames = 0;
+    bridge->align_jitter_target = 0;
+    bridge->align_skip = 0;
+    bridge->source_latency_time = 0;
+}
+
+void JopaSession::pulse_on_subscribe(pa_context* c, pa_subscription_event_type_t t, uint32_t idx, void* userdata) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(userdata);
+
+    if((t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) != PA_SUBSCRIPTION_EVENT_SINK_INPUT) {
+        return;
+    }
+    // New sink inputs and moves to another sink both need the sink input info
+    if((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
+        self->app_remove(idx);
+    } else if(!pulse_check_operation(pa_context_get_sink_input_info(c, idx, pulse_on_get_sink_input_info, self))) {
+        self->pulse_fail("Unable to query PulseAudio for sink input information");
+    }
+}
+
+void JopaSession::pulse_on_get_sink_input_info(pa_context*, pa_sink_input_info const* i, int eol, void* userdata) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(userdata);
+
+    // The sink input may be gone by the time the query is answered
+    if(eol < 0 || i == nullptr) {
+        return;
+    }
+    self->app_update(i);
+}
+
+void JopaSession::app_update(pa_sink_input_info const* i) {
+    // The playback streams of jopa are sink inputs as well
+    if(i->client == pa_context_get_index(pulse_context)) {
+        return;
+    }
+    Bridge* parent = nullptr;
+    for(Bridge* bridge : bridges) {
+        if(bridge->direction == Direction::monitor && !bridge->application && bridge->sink_index == i->sink) {
+            parent = bridge;
+            break;
+        }
+    }
+    for(Bridge* bridge : bridges) {
+        if(bridge->application && bridge->sink_input == i->index && (bridge->app_state == AppState::attaching || bridge->app_state == AppState::attached)) {
+            if(bridge->parent == parent) {
+                return;
+            }
+            // Moved to another sink, the ports follow it there
+            app_remove(i->index);
+            break;
+        }
+    }
+    if(parent == nullptr) {
+        return;
+    }
+
+    char const* app_name = pa_proplist_gets(i->proplist, PA_PROP_APPLICATION_NAME);
+    if(app_name == nullptr) {
+        app_name = i->name != nullptr ? i->name : "unknown";
+    }
+    Bridge* slot = nullptr;
+    for(Bridge* bridge : bridges) {
+        if(bridge->application && bridge->app_state == AppState::unused) {
+            slot = bridge;
+            break;
+        }
+    }
+    if(slot == nullptr) {
+        std::fprintf(stderr, "All %u application slots are taken, not bridging %s.\n", app_slots_max, app_name);
+        return;
+    }
+
+    // Port names must not contain a colon, and are kept short without splitting a UTF-8 sequence
+    std::string label = app_name;
+    if(label.size() > app_name_max) {
+        size_t length = app_name_max;
+        while(length > 0 && (label[length] & 0xc0) == 0x80) {
+            --length;
+        }
+        label.resize(length);
+    }
+    std::replace(label.begin(), label.end(), ':', '-');
+    slot->app_name = app_name;
+    slot->label = (parent->label.empty() ? "" : parent->label + ".") + label + "." + std::to_string(i->index);
+    slot->device = parent->device;
+    slot->parent = parent;
+    slot->sink_input = i->index;
+    slot->app_format = i->sample_spec.format;
+    app_schedule(slot, true);
+}
+
+void JopaSession::app_remove(uint32_t sink_input) {
+    for(Bridge* bridge : bridges) {
+        if(bridge->application && bridge->sink_input == sink_input && (bridge->app_state == AppState::attaching || bridge->app_state == AppState::attached)) {
+            pulse_disconnect_stream(bridge);
+            app_schedule(bridge, false);
+        }
+    }
+}
+
+void JopaSession::app_schedule(Bridge* bridge, bool attach) {
+    bridge->app_state = attach ? AppState::attaching : AppState::detaching;
+    // The worker thread is gone once the destructor disconnects
+    if(worker_started) {
+        AppOperation operation = { bridge, attach };
+        app_operations.push(operation);
+        sem_post(&worker_wakeup);
+    }
+}
+
+void JopaSession::app_attach(Bridge* bridge) {
+    // The label stays put while the slot is attaching
+    bool registered = jack_register_ports(bridge);
+
+    PulseThreadedMainloopLocker locker(pulse_mainloop);
+    if(!registered) {
+        // Unless a detach is already queued to clean up
+        if(bridge->app_state == AppState::attaching) {
+            bridge->app_state = AppState::unused;
+        }
+        return;
+    }
+    // The slot starts over from where init() leaves every other bridge. Neither
+    // the JACK process thread nor a stream touches the slot before it is attached.
+    bridge->ringbuffer.load()->reset();
+    bridge->jitter.reset(std::max(jitter_min_target(jack_buffer_size), std::min<uint32_t>(jack_buffer_size, jitter_max_target(jack_buffer_size))));
+    bridge->target_fill.set(bridge->jitter.target);
+    for(JopaCounter& counter : bridge->xrun_count) {
+        counter.set(0);
+    }
+    for(JopaCounter& counter : bridge->fill_histogram) {
+        counter.set(0);
+    }
+    bridge->active = false;
+    bridge->ports_silenced = false;
+    bridge->names.publish(bridge->label, bridge->app_name, bridge->device);
+    bridge->attached.store(true, std::memory_order_release);
+    std::fprintf(stderr, "%s is %s, on ports %s_monitor_*.\n", bridge->title.c_str(), bridge->app_name.c_str(), bridge->label.c_str());
+
+    if(bridge->app_state != AppState::attaching) {
+        return;
+    }
+    bridge->app_state = AppState::attached;
+    if(!pulse_reconnecting) {
+        pulse_connect_stream(bridge, bridge->app_format, bridge->parent->monitor_source.c_str());
+    }
+}
+
+void JopaSession::app_detach(Bridge* bridge) {
+    // Wait for the JACK process thread to finish any cycle that still saw the ports,
+    // see free_retired_ringbuffers. No cycles run while JACK is stopped.
+    bridge->attached.store(false, std::memory_order_release);
+    uint64_t cycle = jack_cycles.get();
+    for(unsigned i = 0; i < 100 && jack_cycles.get() <= cycle; ++i) {
+        usleep(1000);
+    }
+    for(unsigned ch = 0; ch < num_channels; ++ch) {
+        if(bridge->ports[ch] != nullptr) {
+            jack_port_unregister(jack_client, bridge->ports[ch]);
+            bridge->ports[ch] = nullptr;
+        }
+    }
+
+    PulseThreadedMainloopLocker locker(pulse_mainloop);
+    std::fprintf(stderr, "%s (%s) is gone.\n", bridge->title.c_str(), bridge->app_name.c_str());
+    bridge->app_state = AppState::unused;
+    bridge->sink_input = PA_INVALID_INDEX;
+    bridge->parent = nullptr;
+}
+
+void JopaSession::estimate_latency(Bridge* bridge) {
+    // Until PulseAudio reports the real figure, assume it keeps exactly the requested buffer
+    pa_buffer_attr buffer_attr = pulse_calc_buffer_attr(bridge);
+    uint32_t pulse_buffer = bridge->direction == Direction::playback ? buffer_attr.tlength : buffer_attr.fragsize;
+    bridge->latency.set(bridge->jitter.target + pulse_buffer / pulse_frame_size(bridge));
+}
+
+void JopaSession::report_latency() {
+    bool changed = false;
+    for(Bridge* bridge : bridges) {
+        uint64_t latency = bridge->latency.get();
+        uint64_t reported_latency = bridge->reported_latency.get();
+        // Ignore measurement noise, every update makes JACK walk the whole graph
+        uint64_t difference = latency > reported_latency ? latency - reported_latency : reported_latency - latency;
+        if(difference > reported_latency / 16) {
+            bridge->reported_latency.set(latency);
+            changed = true;
+        }
+    }
+    if(changed) {
+        jack_recompute_total_latencies(jack_client);
+    }
+}
+
+void JopaSession::free_retired_ringbuffers(bool force) {
+    RetiredRingbuffer retired;
+    while(retired_ringbuffers.pop(retired)) {
+        retired_ringbuffers_pending.push_back(retired);
+    }
+    // jack_cycles is incremented at the end of each cycle, so once it moved past the value
+    // recorded at swap time, no cycle holding the old pointer can still be running
+    uint64_t cycles = jack_cycles.get();
+    auto it = retired_ringbuffers_pending.begin();
+    while(it != retired_ringbuffers_pending.end()) {
+        if(force || cycles > it->cycle) {
+            JopaRing::destroy(it->ringbuffer);
+            it = retired_ringbuffers_pending.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void JopaSession::post_xrun(XrunEventQueue& queue, XrunType type, Bridge* bridge, size_t available, size_t required, jack_nframes_t frame_time) {
+    // Each bridge and type has exactly one producer thread, see XrunEventQueue
+    bridge->xrun_count[type].add(1);
+    XrunEvent event = { type, bridge, available, required, frame_time };
+    if(!queue.push(event)) {
+        xrun_events_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void JopaSession::drain_xrun_events() {
+    pa_usec_t now = pa_rtclock_now();
+
+    // Print the first event of each kind right away, count the rest
+    XrunEvent event;
+    XrunEventQueue* queues[] = { &jack_xrun_events, &pulse_xrun_events };
+    for(XrunEventQueue* queue : queues) {
+        while(queue->pop(event)) {
+            Bridge* bridge = event.bridge;
+            pa_usec_t& last_report = bridge->xrun_last_report[event.type];
+            if(last_report != 0 && now - last_report < xrun_report_interval) {
+                ++bridge->xrun_suppressed[event.type];
+                continue;
+            }
+            last_report = now;
+            switch(event.type) {
+            case xrun_overflow:
+                std::fprintf(stderr, "%s buffer overflow: %zu < %zu at frame %u\n", bridge->title.c_str(), event.available, event.required, event.frame_time);
+                break;
+            case xrun_underflow:
+                std::fprintf(stderr, "%s buffer underflow: %zu < %zu at frame %u\n", bridge->title.c_str(), event.available, event.required, event.frame_time);
+                break;
+            default:
+                std::fprintf(stderr, "%s buffer overflow: %zu bytes hole at frame %u\n", bridge->title.c_str(), event.required, event.frame_time);
+                break;
+            }
+        }
+    }
+
+    // Summarize what was held back once the interval is over
+    static char const* const xrun_names[num_xrun_types] = { "overflows", "underflows", "holes" };
+    for(Bridge* bridge : bridges) {
+        for(unsigned type = 0; type < num_xrun_types; ++type) {
+            if(bridge->xrun_suppressed[type] != 0 && now - bridge->xrun_last_report[type] >= xrun_report_interval) {
+                std::fprintf(stderr, "%s buffer: %u more %s in the last %.1lf s\n", bridge->title.c_str(), bridge->xrun_suppressed[type], xrun_names[type], (double) (now - bridge->xrun_last_report[type]) / PA_USEC_PER_SEC);
+                bridge->xrun_suppressed[type] = 0;
+                bridge->xrun_last_report[type] = now;
+            }
+        }
+    }
+
+    unsigned dropped = xrun_events_dropped.exchange(0, std::memory_order_relaxed);
+    if(dropped != 0) {
+        std::fprintf(stderr, "%u buffer events were lost because the event queue was full\n", dropped);
+    }
+}
+
+void JopaSession::pulse_update_drift(Bridge* bridge) {
+    if(!pulse_is_stream_ready(bridge->stream)) {
+        return;
+    }
+
+    pa_usec_t pulse_latency;
+    int pulse_latency_negative;
+    bool pulse_latency_known = pa_stream_get_latency(bridge->stream, &pulse_latency, &pulse_latency_negative) == 0;
+    if(pulse_latency_known) {
+        if(pulse_latency_negative) {
+            pulse_latency = 0;
+        }
+        bridge->pulse_latency.set(pulse_latency);
+        // Fill level is steered toward the jitter target plus alignment, so that is what adds to the latency
+        bridge->latency.set(std::lround(bridge->jitter.target + bridge->align_frames) + pulse_latency * sample_rate / PA_USEC_PER_SEC);
+    }
+
+    pa_usec_t now = pa_rtclock_now();
+    JitterController& jitter = bridge->jitter;
+    uint32_t old_target = jitter.target;
+    if(jitter.update(bridge->xrun_count[xrun_underflow].get(), jitter_min_target(jack_buffer_size), jitter_max_target(jack_buffer_size), jack_buffer_size, now)) {
+        bridge->target_fill.set(jitter.target);
+        if(jitter.target > old_target) {
+            // Grow the fill at once, like align_capture does. Left to the drift controller
+            // it would take minutes, and further underflows would wind the target up meanwhile.
+            // Playback holds back reads by feeding PulseAudio faded out silence instead.
+            size_t grown = jitter.target - old_target;
+            if(bridge->direction == Direction::playback) {
+                if(!pulse_write_concealed(bridge, grown)) {
+                    return;
+                }
+            } else {
+                ringbuffer_write_silence(bridge->ringbuffer, grown);
+            }
+            bridge->drift.shift((double) grown);
+            std::fprintf(stderr, "%s buffer grown to %u samples (%.2lf ms).\n", bridge->title.c_str(), jitter.target, 1000.0 * jitter.target / sample_rate);
+        }
+    }
+
+    // Bytes that PulseAudio has received from us but not yet played (playback),
+    // or captured but not yet handed to us (record), read after the growth above
+    pa_timing_info const* timing_info = pa_stream_get_timing_info(bridge->stream);
+    if(timing_info == nullptr || timing_info->write_index_corrupt || timing_info->read_index_corrupt) {
+        return;
+    }
+    int64_t pulse_fill = std::max<int64_t>(timing_info->write_index - timing_info->read_index, 0);
+
+    double ring_fill = (double) bridge->ringbuffer.load()->fill();
+    double pulse_fill_frames = (double) (pulse_fill / pulse_frame_size(bridge));
+    double ring_target = jitter.target;
+    if(bridge->direction != Direction::playback && pulse_latency_known) {
+        // What PulseAudio holds beyond the stream buffer sits in the device
+        ring_target += align_capture(bridge, (double) pulse_latency * sample_rate / PA_USEC_PER_SEC - pulse_fill_frames, now);
+    }
+    DriftController& drift = bridge->drift;
+    if(!drift.update(ring_fill, ring_target, pulse_fill_frames, sample_rate, now)) {
+        return;
+    }
+
+    // Playback drains faster at a higher rate, record fills slower at a lower rate
+    double ratio = bridge->direction == Direction::playback ? 1 + drift.correction : 1 - drift.correction;
+    uint32_t rate = (uint32_t) std::lround(sample_rate * ratio);
+    if(rate != drift.applied_rate) {
+        if(!pulse_check_operation(pa_stream_update_sample_rate(bridge->stream, rate, nullptr, nullptr))) {
+            pulse_fail("Unable to adjust PulseAudio sample rate");
+            return;
+        }
+        drift.applied_rate = rate;
+    }
+}
+
+double JopaSession::align_capture(Bridge* bridge, double source_latency, pa_usec_t now) {
+    // Smooth the device latency like the drift controller smooths the fill level
+    if(bridge->source_latency_time == 0) {
+        bridge->source_latency = source_latency;
+    } else {
+        double alpha = (double) (now - bridge->source_latency_time) / PA_USEC_PER_SEC / drift_filter_time;
+        bridge->source_latency += (source_latency - bridge->source_latency) * (alpha < 1 ? alpha : 1);
+    }
+    bridge->source_latency_time = now;
+    if(!bridge->drift.is_settled()) {
+        return bridge->align_frames;
+    }
+
+    // Every settled record and monitor stream is steered toward the same end-to-end
+    // latency, counted from the moment the device captured a sample until JACK reads it
+    auto natural_latency = [](Bridge const* b) {
+        return b->jitter.target + b->drift.pulse_baseline() + b->source_latency;
+    };
+    double aligned_latency = natural_latency(bridge);
+    for(Bridge* other : bridges) {
+        if(other->direction != Direction::playback && !other->corked && other->online.load(std::memory_order_relaxed) && other->drift.is_settled() && other->source_latency_time != 0) {
+            aligned_latency = std::max(aligned_latency, natural_latency(other));
+        }
+    }
+
+    // Large changes, such as another stream starting up, are applied at once. When the
+    // jitter target of this stream moved too, the offset mostly trades places with it,
+    // the drift controller closes whatever remains as it did before.
+    double align_frames = aligned_latency - natural_latency(bridge);
+    double step = std::round(align_frames - bridge->align_frames);
+    bool first = bridge->align_jitter_target == 0;
+    if((first || bridge->jitter.target == bridge->align_jitter_target) && std::fabs(step) >= align_step_frames) {
+        if(step > 0) {
+            ringbuffer_write_silence(bridge->ringbuffer, (size_t) step);
+        } else {
+            bridge->align_skip += (size_t) -step;
+        }
+        bridge->drift.shift(step);
+        std::fprintf(stderr, "%s stream delayed by %.0lf samples (%.2lf ms) to line up with the other streams.\n",
+            bridge->title.c_str(), align_frames, 1000.0 * align_frames / sample_rate);
+    }
+    bridge->align_frames = align_frames;
+    bridge->align_jitter_target = bridge->jitter.target;
+    bridge->align_offset.set((uint64_t) std::lround(align_frames));
+    return align_frames;
+}
+
+void JopaSession::ringbuffer_write_silence(JopaRing* ringbuffer, size_t nframes) const {
+    nframes = std::min(nframes, ringbuffer->write_space(nframes));
+    std::fill_n(ringbuffer->write_pointer(), nframes * num_channels, 0.0f);
+    ringbuffer->write_advance(nframes);
+}
+
+void* JopaSession::stats_main(void* arg) {
+    JopaSession* self = reinterpret_cast<JopaSession*>(arg);
+
+    for(;;) {
+        int client = accept(self->stats_socket, nullptr, nullptr);
+        if(client < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // The socket was shut down
+            return nullptr;
+        }
+        std::string stats = self->format_stats();
+        char const* data = stats.data();
+        size_t nbytes = stats.size();
+        while(nbytes != 0) {
+            ssize_t written = send(client, data, nbytes, MSG_NOSIGNAL);
+            if(written <= 0) {
+                break;
+            }
+            data += written;
+            nbytes -= written;
+        }
+        close(client);
+    }
+}
+
+std::string JopaSession::format_stats() const {
+    // One "key value..." pair per line
+    std::string stats;
+    char line[256];
+    std::snprintf(line, sizeof line, "sample_rate %u\nbuffer_size %u\nchannels %u\n", sample_rate.load(), jack_buffer_size.load(), num_channels);
+    stats += line;
+    std::snprintf(line, sizeof line, "jack_cycles %llu\njack_xruns %llu\nprocess_time_max_us %llu\n",
+        (unsigned long long) jack_cycles.get(), (unsigned long long) jack_xruns.get(), (unsigned long long) process_time_max.get());
+    stats += line;
+    stats += "process_time_us_below";
+    for(unsigned i = 0; i < stats_time_buckets - 1; ++i) {
+        stats += " " + std::to_string(1ULL << i);
+    }
+    stats += " inf\nprocess_time_histogram";
+    for(unsigned i = 0; i < stats_time_buckets; ++i) {
+        stats += " " + std::to_string(process_time_histogram[i].get());
+    }
+    stats += "\n";
+
+    static char const* const direction_names[] = { "playback", "record", "monitor" };
+    for(size_t index = 0; index < bridges.size(); ++index) {
+        Bridge const* bridge = bridges[index];
+        if(!bridge->attached.load()) {
+            continue;
+        }
+        // Application slots are renamed by the worker thread, see JopaNames
+        std::string label;
+        std::string application;
+        std::string device;
+        bridge->names.read(&label, &application, &device);
+        std::string prefix = "bridge" + std::to_string(index) + ".";
+        stats += prefix + "direction " + direction_names[(int) bridge->direction] + "\n";
+        stats += prefix + "label " + label + "\n";
+        if(bridge->application) {
+            stats += prefix + "application " + application + "\n";
+        }
+        stats += prefix + "device " + (device.empty() ? "(default)" : device) + "\n";
+        stats += prefix + "overflows " + std::to_string(bridge->xrun_count[xrun_overflow].get()) + "\n";
+        stats += prefix + "underflows " + std::to_string(bridge->xrun_count[xrun_underflow].get()) + "\n";
+        stats += prefix + "holes " + std::to_string(bridge->xrun_count[xrun_hole].get()) + "\n";
+        stats += prefix + "pulse_latency_us " + std::to_string(bridge->pulse_latency.get()) + "\n";
+        stats += prefix + "target_fill_frames " + std::to_string(bridge->target_fill.get()) + "\n";
+        stats += prefix + "active " + std::to_string((int) bridge->active.load()) + "\n";
+        if(bridge->direction != Direction::playback) {
+            stats += prefix + "align_offset_frames " + std::to_string(bridge->align_offset.get()) + "\n";
+        }
+        if(metering) {
+            float peak[PA_CHANNELS_MAX];
+            float rms[PA_CHANNELS_MAX];
+            bridge->levels.read(peak, rms, num_channels);
+            stats += prefix + "peak_dbfs";
+            for(unsigned ch = 0; ch < num_channels; ++ch) {
+                std::snprintf(line, sizeof line, " %.1f", 20 * std::log10(peak[ch]));
+                stats += line;
+            }
+            stats += "\n" + prefix + "rms_dbfs";
+            for(unsigned ch = 0; ch < num_channels; ++ch) {
+                std::snprintf(line, sizeof line, " %.1f", 20 * std::log10(rms[ch]));
+                stats += line;
+            }
+            stats += "\n";
+        }
+        stats += prefix + "fill_histogram";
+        for(unsigned i = 0; i < stats_fill_buckets; ++i) {
+            stats += " " + std::to_string(bridge->fill_histogram[i].get());
+        }
+        stats += "\n";
+    }
+    return stats;
+}
+
+uint32_t JopaSession::jitter_min_target(jack_nframes_t buffer_size) const {
+    // Below half a period the ringbuffer runs dry between JACK cycles
+    return std::max<uint32_t>(std::lround(min_latency * sample_rate), buffer_size / 2);
+}
+
+uint32_t JopaSession::jitter_max_target(jack_nframes_t buffer_size) const {
+    return std::max<uint32_t>(std::lround(max_latency * sample_rate), jitter_min_target(buffer_size));
+}
+
+size_t JopaSession::ringbuffer_frames(jack_nframes_t buffer_size) const {
+    // Room for the target fill, one JACK period in flight, and as much again for bursts
+    return 2 * ((size_t) jitter_max_target(buffer_size) + buffer_size);
+}
+
+bool JopaSession::pulse_is_stream_ready(pa_stream* p) {
+    return p != nullptr && pa_stream_get_state(p) == PA_STREAM_READY;
+}
+
+bool JopaSession::pulse_check_operation(pa_operation* o) {
+    if(o == nullptr) {
+        return false;
+    } else {
+        pa_operation_unref(o);
+        return true;
+    }
+}
+
+pa_sample_format_t JopaSession::pulse_choose_format(pa_sample_format_t native_format) const {
+    if(!use_native_format) {
+        return PA_SAMPLE_FLOAT32NE;
+    }
+    // Integer devices get the matching native-endian integer format, PulseAudio
+    // only has to adjust byte order or packing then. Anything else stays float.
+    switch(native_format) {
+    case PA_SAMPLE_S16LE:
+    case PA_SAMPLE_S16BE:
+        return PA_SAMPLE_S16NE;
+    case PA_SAMPLE_S24LE:
+    case PA_SAMPLE_S24BE:
+    case PA_SAMPLE_S24_32LE:
+    case PA_SAMPLE_S24_32BE:
+    case PA_SAMPLE_S32LE:
+    case PA_SAMPLE_S32BE:
+        return PA_SAMPLE_S32NE;
+    default:
+        return PA_SAMPLE_FLOAT32NE;
+    }
+}
+
+pa_sample_spec JopaSession::pulse_calc_sample_spec(pa_sample_format_t format) const {
+    pa_sample_spec sample_spec = {
+        .format   = format,
+        .rate     = sample_rate,
+        .channels = (uint8_t) num_channels
+    };
+    return sample_spec;
+}
+
+size_t JopaSession::pulse_frame_size(Bridge const* bridge) const {
+    return num_channels * pa_sample_size_of_format(bridge->sample_format);
+}
+
+pa_buffer_attr JopaSession::pulse_calc_buffer_attr(Bridge const* bridge) const {
+    bool record = bridge->direction != Direction::playback;
+    pa_buffer_attr buffer_attr = {
+        .maxlength = (uint32_t) -1,
+        .tlength   = record ? (uint32_t) -1 : (uint32_t) (jack_buffer_size * pulse_frame_size(bridge)),
+        .prebuf    = (uint32_t) -1,
+        .minreq    = (uint32_t) -1,
+        .fragsize  = record ? (uint32_t) (jack_buffer_size * pulse_frame_size(bridge)) : (uint32_t) -1
+    };
+    return buffer_attr;
+}
+
+void JopaSession::DriftController::reset() {
+    *this = DriftController();
+}
+
+bool JopaSession::DriftController::update(double ring_fill, double ring_target, double pulse_fill, double rate, pa_usec_t now) {
+    double total_fill = ring_fill + pulse_fill;
+
+    // Learn how much PulseAudio keeps buffered by itself before locking the setpoint
+    if(!settled) {
+        if(settle_until == 0) {
+            settle_until = now + drift_settle_time;
+        }
+        baseline_sum += pulse_fill;
+        ++baseline_count;
+        if(now < settle_until) {
+            return false;
+        }
+        baseline = baseline_sum / baseline_count;
+        filtered = total_fill;
+        last_sample = now;
+        last_update = now;
+        settled = true;
+        return false;
+    }
+
+    // Smooth out the sawtooth caused by JACK and PulseAudio moving whole fragments
+    double sample_interval = (double) (now - last_sample) / PA_USEC_PER_SEC;
+    last_sample = now;
+    double alpha = sample_interval / drift_filter_time;
+    filtered += (total_fill - filtered) * (alpha < 1 ? alpha : 1);
+
+    if(now - last_update < drift_update_interval) {
+        return false;
+    }
+    double update_interval = (double) (now - last_update) / PA_USEC_PER_SEC;
+    last_update = now;
+
+    // PI controller, error is the amount of excess audio in seconds
+    // The ring target moves with the jitter buffer, the PulseAudio share stays as learned
+    double error = (filtered - (ring_target + baseline)) / rate;
+    double correction_limit = drift_max_correction;
+    double integral_limit = correction_limit / drift_integral_gain;
+    integral = std::max(-integral_limit, std::min(integral + error * update_interval, integral_limit));
+    double output = drift_proportional_gain * error + drift_integral_gain * integral;
+    correction = std::max(-correction_limit, std::min(output, correction_limit));
+    return true;
+}
+
+void JopaSession::DriftController::shift(double frames) {
+    filtered += frames;
+}
+
+bool JopaSession::DriftController::is_settled() const {
+    return settled;
+}
+
+double JopaSession::DriftController::pulse_baseline() const {
+    return baseline;
+}
+
+void JopaSession::JitterController::reset(uint32_t initial_target) {
+    *this = JitterController();
+    target = initial_target;
+}
+
+void JopaSession::JitterController::clamp(uint32_t min_target, uint32_t max_target) {
+    target = std::max(min_target, std::min(target, max_target));
+}
+
+bool JopaSession::JitterController::update(uint64_t underflows, uint32_t min_target, uint32_t max_target, uint32_t period, pa_usec_t now) {
+    uint32_t old_target = target;
+    if(last_change == 0) {
+        last_change = now;
+        last_underflow = now;
+    }
+    if(underflows != last_underflows) {
+        last_underflows = underflows;
+        last_underflow = now;
+        // One burst of trouble usually reports several underflows, grow only once for it
+        if(now - last_change >= jitter_grow_holdoff) {
+            target += std::max<uint32_t>(period / 2, 1);
+            last_change = now;
+        }
+    } else if(now - last_underflow >= jitter_stable_time && now - last_change >= jitter_shrink_interval) {
+        target -= std::min(target, std::max<uint32_t>(period / 8, 1));
+        last_change = now;
+    }
+    clamp(min_target, max_target);
+    return target != old_target;
+}
+
+void JopaCounter::add(uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void JopaCounter::set(uint64_t n) {
+    value.store(n, std::memory_order_relaxed);
+}
+
+uint64_t JopaCounter::get() const {
+    return value.load(std::memory_order_relaxed);
+}
+
+void JopaLevels::publish(float const* new_peak, float const* new_rms, unsigned channels) {
+    uint32_t before = sequence.load(std::memory_order_relaxed);
+    sequence.store(before + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for(unsigned ch = 0; ch < channels; ++ch) {
+        peak[ch].store(new_peak[ch], std::memory_order_relaxed);
+        rms[ch].store(new_rms[ch], std::memory_order_relaxed);
+    }
+    sequence.store(before + 2, std::memory_order_release);
+}
+
+void JopaLevels::read(float* out_peak, float* out_rms, unsigned channels) const {
+    uint32_t before;
+    uint32_t after;
+    do {
+        before = sequence.load(std::memory_order_acquire);
+        for(unsigned ch = 0; ch < channels; ++ch) {
+            out_peak[ch] = peak[ch].load(std::memory_order_relaxed);
+            out_rms[ch] = rms[ch].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = sequence.load(std::memory_order_relaxed);
+    } while(before % 2 != 0 || before != after);
+}
+
+void JopaNames::store(std::atomic<char>* name, std::string const& value) {
+    size_t length = std::min(value.size(), name_max - 1);
+    for(size_t i = 0; i < length; ++i) {
+        name[i].store(value[i], std::memory_order_relaxed);
+    }
+    name[length].store('\0', std::memory_order_relaxed);
+}
+
+std::string JopaNames::load(std::atomic<char> const* name) {
+    std::string value;
+    for(size_t i = 0; i < name_max; ++i) {
+        char c = name[i].load(std::memory_order_relaxed);
+        if(c == '\0') {
+            break;
+        }
+        value += c;
+    }
+    return value;
+}
+
+void JopaNames::publish(std::string const& new_label, std::string const& new_application, std::string const& new_device) {
+    uint32_t before = sequence.load(std::memory_order_relaxed);
+    sequence.store(before + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    store(label, new_label);
+    store(application, new_application);
+    store(device, new_device);
+    sequence.store(before + 2, std::memory_order_release);
+}
+
+void JopaNames::read(std::string* out_label, std::string* out_application, std::string* out_device) const {
+    uint32_t before;
+    uint32_t after;
+    do {
+        before = sequence.load(std::memory_order_acquire);
+        *out_label = load(label);
+        *out_application = load(application);
+        *out_device = load(device);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = sequence.load(std::memory_order_relaxed);
+    } while(before % 2 != 0 || before != after);
+}
+
+template<typename T, size_t capacity>
+bool JopaSpscQueue<T, capacity>::push(T const& item) {
+    size_t index = write_index.load(std::memory_order_relaxed);
+    if(index - read_index.load(std::memory_order_acquire) == capacity) {
+        return false;
+    }
+    slots[index & (capacity - 1)] = item;
+    write_index.store(index + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T, size_t capacity>
+bool JopaSpscQueue<T, capacity>::pop(T& item) {
+    size_t index = read_index.load(std::memory_order_relaxed);
+    if(index == write_index.load(std::memory_order_acquire)) {
+        return false;
+    }
+    item = slots[index & (capacity - 1)];
+    read_index.store(index + 1, std::memory_order_release);
+    return true;
+}
+
+JopaRing* JopaRing::create(size_t min_frames, unsigned channels, bool populate) {
+    // Both mappings must start on a page boundary
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t frame_size = channels * sizeof (float);
+    size_t capacity = 1;
+    while(capacity < min_frames || capacity * frame_size % page_size != 0) {
+        capacity *= 2;
+    }
+    size_t mapping_size = capacity * frame_size;
+
+    int fd = memfd_create("jopa-ring", MFD_CLOEXEC);
+    if(fd < 0) {
+        return nullptr;
+    }
+    // Reserve the address range for both mappings, then map the memory into each half
+    char* address = nullptr;
+    void* reserved = mmap(nullptr, 2 * mapping_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(reserved != MAP_FAILED) {
+        address = reinterpret_cast<char*>(reserved);
+        int flags = MAP_SHARED | MAP_FIXED | (populate ? MAP_POPULATE : 0);
+        if(ftruncate(fd, mapping_size) != 0
+            || mmap(address, mapping_size, PROT_READ | PROT_WRITE, flags, fd, 0) == MAP_FAILED
+            || mmap(address + mapping_size, mapping_size, PROT_READ | PROT_WRITE, flags, fd, 0) == MAP_FAILED) {
+            munmap(address, 2 * mapping_size);
+            address = nullptr;
+        }
+    }
+    close(fd);
+    if(address == nullptr) {
+        return nullptr;
+    }
+
+    // Plain new does not honor the cache line alignment before C++17
+    void* memory;
+    if(posix_memalign(&memory, 64, sizeof (JopaRing)) != 0) {
+        munmap(address, 2 * mapping_size);
+        return nullptr;
+    }
+    JopaRing* ring = new(memory) JopaRing;
+    ring->data = reinterpret_cast<float*>(address);
+    ring->capacity = capacity;
+    ring->frame_samples = channels;
+    ring->mapping_size = mapping_size;
+    return ring;
+}
+
+JopaRing::~JopaRing() {
+    munmap(data, 2 * mapping_size);
+}
+
+void JopaRing::destroy(JopaRing* ring) {
+    ring->~JopaRing();
+    std::free(ring);
+}
+
+size_t JopaRing::write_space(size_t wanted) {
+    size_t index = write_index.load(std::memory_order_relaxed);
+    if(capacity - (index - cached_read_index) < wanted) {
+        cached_read_index = read_index.load(std::memory_order_acquire);
+    }
+    return capacity - (index - cached_read_index);
+}
+
+float* JopaRing::write_pointer() const {
+    return data + (write_index.load(std::memory_order_relaxed) & (capacity - 1)) * frame_samples;
+}
+
+void JopaRing::write_advance(size_t nframes) {
+    write_index.store(write_index.load(std::memory_order_relaxed) + nframes, std::memory_order_release);
+}
+
+size_t JopaRing::read_space(size_t wanted) {
+    size_t index = read_index.load(std::memory_order_relaxed);
+    if(cached_write_index - index < wanted) {
+        cached_write_index = write_index.load(std::memory_order_acquire);
+    }
+    return cached_write_index - index;
+}
+
+float* JopaRing::read_pointer() const {
+    return data + (read_index.load(std::memory_order_relaxed) & (capacity - 1)) * frame_samples;
+}
+
+void JopaRing::read_advance(size_t nframes) {
+    read_index.store(read_index.load(std::memory_order_relaxed) + nframes, std::memory_order_release);
+}
+
+size_t JopaRing::fill() const {
+    // The read index first, so the difference never goes negative
+    size_t index = read_index.load(std::memory_order_acquire);
+    return write_index.load(std::memory_order_acquire) - index;
+}
+
+size_t JopaRing::frames() const {
+    return capacity;
+}
+
+void JopaRing::reset() {
+    write_index.store(0);
+    read_index.store(0);
+    cached_read_index = 0;
+    cached_write_index = 0;
+}
+
+bool JopaRing::lock() {
+    // Both mappings, so neither side takes a fault on its page tables either
+    return mlock(data, 2 * mapping_size) == 0;
+}
+
+JopaSession::PulseThreadedMainloopLocker::PulseThreadedMainloopLocker(pa_threaded_mainloop* mainloop) {
+    this->mainloop = mainloop;
+    if(mainloop) {
+        pa_threaded_mainloop_lock(mainloop);
+    }
+}
+
+JopaSession::PulseThreadedMainloopLocker::~PulseThreadedMainloopLocker() {
+    if(mainloop) {
+        pa_threaded_mainloop_unlock(mainloop);
+    }
+}
+
+void JopaKernels::interleave_scalar(float* dst, float* const* src, unsigned channels, size_t offset, size_t nframes) {
+    for(unsigned ch = 0; ch < channels; ++ch) {
+        float const* channel = src[ch] + offset;
+        for(size_t i = 0; i < nframes; ++i) {
+            dst[i * channels + ch] = channel[i];
         }
     }
-    for(unsigned ch = 0; ch < num_channels; ++ch) {
-        if(jack_capture_ports[ch] != nullptr) {
-            jack_port_unregister(jack_client, jack_capture_ports[ch]);
-            jack_capture_ports[ch] = nullptr;
+}
+
+void JopaKernels::deinterleave_scalar(float* const* dst, float const* src, unsigned channels, size_t offset, size_t nframes) {
+    for(unsigned ch = 0; ch < channels; ++ch) {
+        float* channel = dst[ch] + offset;
+        for(size_t i = 0; i < nframes; ++i) {
+            channel[i] = src[i * channels + ch];
         }
     }
-    for(unsigned ch = 0; ch < num_channels; ++ch) {
-        if(jack_playback_ports[ch] != nullptr) {
-            jack_port_unregister(jack_client, jack_playback_ports[ch]);
-            jack_playback_ports[ch] = nullptr;
+}
+
+template<unsigned channels>
+void JopaKernels::interleave_fixed(float* dst, float* const* src, unsigned, size_t offset, size_t nframes) {
+    float const* channel[channels];
+    for(unsigned ch = 0; ch < channels; ++ch) {
+        channel[ch] = src[ch] + offset;
+    }
+    for(size_t i = 0; i < nframes; ++i) {
+        for(unsigned ch = 0; ch < channels; ++ch) {
+            dst[i * channels + ch] = channel[ch][i];
         }
     }
-    if(jack_client != nullptr) {
-        jack_client_close(jack_client);
-        jack_client = nullptr;
+}
+
+template<unsigned channels>
+void JopaKernels::deinterleave_fixed(float* const* dst, float const* src, unsigned, size_t offset, size_t nframes) {
+    float* channel[channels];
+    for(unsigned ch = 0; ch < channels; ++ch) {
+        channel[ch] = dst[ch] + offset;
+    }
+    for(size_t i = 0; i < nframes; ++i) {
+        for(unsigned ch = 0; ch < channels; ++ch) {
+            channel[ch][i] = src[i * channels + ch];
+        }
     }
 }
 
-void JopaSession::jack_on_shutdown(void* arg) {
-    std::exit(0);
+template<>
+void JopaKernels::interleave_fixed<1>(float* dst, float* const* src, unsigned, size_t offset, size_t nframes) {
+    std::memcpy(dst, src[0] + offset, nframes * sizeof (float));
 }
 
-int JopaSession::jack_on_process(jack_nframes_t nframes, void* arg) {
-    JopaSession* self = reinterpret_cast<JopaSession*>(arg);
+template<>
+void JopaKernels::deinterleave_fixed<1>(float* const* dst, float const* src, unsigned, size_t offset, size_t nframes) {
+    std::memcpy(dst[0] + offset, src, nframes * sizeof (float));
+}
 
-    self->jack_finish_connect();
+#ifdef JOPA_X86_KERNELS
 
-    // Copy playback stream
-    {
-        jack_sample_t* jack_buffer[num_channels];
-        for(unsigned ch = 0; ch < num_channels; ++ch) {
-            if(self->jack_playback_ports[ch] != nullptr) {
-                jack_buffer[ch] = (jack_sample_t*) jack_port_get_buffer(self->jack_playback_ports[ch], nframes);
-            } else {
-                jack_buffer[ch] = nullptr;
-            }
-        }
-        size_t buffer_space = jack_ringbuffer_write_space(self->jack_playback_ringbuffer);
-        size_t buffer_required = nframes * (num_channels * sizeof (pulse_sample_t));
-        if(buffer_space >= buffer_required) {
-            jack_ringbuffer_data_t write_vector[2];
-            jack_ringbuffer_get_write_vector(self->jack_playback_ringbuffer, write_vector);
-            for(jack_nframes_t i = 0; i < nframes; ++i) {
-                for(unsigned ch = 0; ch < num_channels; ++ch) {
-                    jack_nframes_t index = i * num_channels + ch;
-                    size_t offset = index * sizeof (pulse_sample_t);
-                    if(offset < write_vector[0].len) {
-                        *(pulse_sample_t*) &write_vector[0].buf[offset] = jack_buffer[ch][i];
-                    } else {
-                        *(pulse_sample_t*) &write_vector[1].buf[offset - write_vector[0].len] = jack_buffer[ch][i];
-                    }
-                }
-            }
-            jack_ringbuffer_write_advance(self->jack_playback_ringbuffer, buffer_required);
-        } else {
-            std::fprintf(stderr, "Playback buffer overflow: %zu < %zu\n", buffer_space, buffer_required);
-        }
+__attribute__((target("sse2")))
+void JopaKernels::interleave_stereo_sse2(float* dst, float* const* src, unsigned, size_t offset, size_t nframes) {
+    float const* left = src[0] + offset;
+    float const* right = src[1] + offset;
+    size_t i = 0;
+    for(; i + 4 <= nframes; i += 4) {
+        __m128 l = _mm_loadu_ps(left + i);
+        __m128 r = _mm_loadu_ps(right + i);
+        _mm_storeu_ps(dst + 2 * i, _mm_unpacklo_ps(l, r));
+        _mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(l, r));
     }
-
-    // Copy record stream
-    {
-        jack_sample_t* jack_buffer[num_channels];
-        for(unsigned ch = 0; ch < num_channels; ++ch) {
-            if(self->jack_capture_ports[ch] != nullptr) {
-                jack_buffer[ch] = (jack_sample_t*) jack_port_get_buffer(self->jack_capture_ports[ch], nframes);
-            } else {
-                jack_buffer[ch] = nullptr;
-            }
-        }
-        size_t buffer_space = jack_ringbuffer_read_space(self->jack_capture_ringbuffer);
-        size_t buffer_required = nframes * (num_channels * sizeof (pulse_sample_t));
-        if(buffer_space >= buffer_required) {
-            jack_ringbuffer_data_t read_vector[2];
-            jack_ringbuffer_get_read_vector(self->jack_capture_ringbuffer, read_vector);
-            for(jack_nframes_t i = 0; i < nframes; ++i) {
-                for(unsigned ch = 0; ch < num_channels; ++ch) {
-                    jack_nframes_t index = i * num_channels + ch;
-                    size_t offset = index * sizeof (pulse_sample_t);
-                    if(offset < read_vector[0].len) {
-                        jack_buffer[ch][i] = *(pulse_sample_t*) &read_vector[0].buf[offset];
-                    } else {
-                        jack_buffer[ch][i] = *(pulse_sample_t*) &read_vector[1].buf[offset - read_vector[0].len];
-                    }
-                }
-            }
-            jack_ringbuffer_read_advance(self->jack_capture_ringbuffer, buffer_required);
-        } else {
-            std::fprintf(stderr, "Record buffer underflow: %zu < %zu\n", buffer_space, buffer_required);
-        }
+    for(; i < nframes; ++i) {
+        dst[2 * i] = left[i];
+        dst[2 * i + 1] = right[i];
     }
+}
 
-    // Copy monitor stream
-    {
-        jack_sample_t* jack_buffer[num_channels];
-        for(unsigned ch = 0; ch < num_channels; ++ch) {
-            if(self->jack_monitor_ports[ch] != nullptr) {
-                jack_buffer[ch] = (jack_sample_t*) jack_port_get_buffer(self->jack_monitor_ports[ch], nframes);
-            } else {
-                jack_buffer[ch] = nullptr;
-            }
-        }
-        size_t buffer_space = jack_ringbuffer_read_space(self->jack_monitor_ringbuffer);
-        size_t buffer_required = nframes * (num_channels * sizeof (pulse_sample_t));
-        if(buffer_space >= buffer_required) {
-            jack_ringbuffer_data_t read_vector[2];
-            jack_ringbuffer_get_read_vector(self->jack_monitor_ringbuffer, read_vector);
-            for(jack_nframes_t i = 0; i < nframes; ++i) {
-                for(unsigned ch = 0; ch < num_channels; ++ch) {
-                    jack_nframes_t index = i * num_channels + ch;
-                    size_t offset = index * sizeof (pulse_sample_t);
-                    if(offset < read_vector[0].len) {
-                        jack_buffer[ch][i] = *(pulse_sample_t*) &read_vector[0].buf[offset];
-                    } else {
-                        jack_buffer[ch][i] = *(pulse_sample_t*) &read_vector[1].buf[offset - read_vector[0].len];
-                    }
-                }
-            }
-            jack_ringbuffer_read_advance(self->jack_monitor_ringbuffer, buffer_required);
-        } else {
-            std::fprintf(stderr, "Monitor buffer underflow: %zu < %zu\n", buffer_space, buffer_required);
-        }
+__attribute__((target("sse2")))
+void JopaKernels::deinterleave_stereo_sse2(float* const* dst, float const* src, unsigned, size_t offset, size_t nframes) {
+    float* left = dst[0] + offset;
+    float* right = dst[1] + offset;
+    size_t i = 0;
+    for(; i + 4 <= nframes; i += 4) {
+        __m128 a = _mm_loadu_ps(src + 2 * i);
+        __m128 b = _mm_loadu_ps(src + 2 * i + 4);
+        _mm_storeu_ps(left + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(right + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    for(; i < nframes; ++i) {
+        left[i] = src[2 * i];
+        right[i] = src[2 * i + 1];
     }
-
-    return 0;
 }
 
-int JopaSession::jack_on_buffer_size(jack_nframes_t nframes, void* arg) {
-    JopaSession* self = reinterpret_cast<JopaSession*>(arg);
-    PulseThreadedMainloopLocker(self->pulse_mainloop);
+__attribute__((target("avx2")))
+void JopaKernels::interleave_stereo_avx2(float* dst, float* const* src, unsigned, size_t offset, size_t nframes) {
+    float const* left = src[0] + offset;
+    float const* right = src[1] + offset;
+    size_t i = 0;
+    for(; i + 8 <= nframes; i += 8) {
+        __m256 l = _mm256_loadu_ps(left + i);
+        __m256 r = _mm256_loadu_ps(right + i);
+        // unpack works within 128-bit lanes, permute puts the lanes back in order
+        __m256 lo = _mm256_unpacklo_ps(l, r);
+        __m256 hi = _mm256_unpackhi_ps(l, r);
+        _mm256_storeu_ps(dst + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+        _mm256_storeu_ps(dst + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+    }
+    for(; i < nframes; ++i) {
+        dst[2 * i] = left[i];
+        dst[2 * i + 1] = right[i];
+    }
+}
 
-    // Reset PulseAudio buffer
-    self->jack_buffer_size = nframes;
-    pa_buffer_attr playback_buffer_attr = self->pulse_calc_buffer_attr(false);
-    pa_buffer_attr record_buffer_attr = self->pulse_calc_buffer_attr(true);
-    if(pulse_is_stream_ready(self->pulse_playback_stream)) {
-        if(!pulse_check_operation(pa_stream_set_buffer_attr(self->pulse_playback_stream, &playback_buffer_attr, nullptr, nullptr))) {
-            pulse_throw_exception(self->pulse_context, "Unable to reset PulseAudio playback buffer");
-        }
+__attribute__((target("avx2")))
+void JopaKernels::deinterleave_stereo_avx2(float* const* dst, float const* src, unsigned, size_t offset, size_t nframes) {
+    float* left = dst[0] + offset;
+    float* right = dst[1] + offset;
+    size_t i = 0;
+    for(; i + 8 <= nframes; i += 8) {
+        __m256 a = _mm256_loadu_ps(src + 2 * i);
+        __m256 b = _mm256_loadu_ps(src + 2 * i + 8);
+        __m256 lo = _mm256_permute2f128_ps(a, b, 0x20);
+        __m256 hi = _mm256_permute2f128_ps(a, b, 0x31);
+        _mm256_storeu_ps(left + i, _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm256_storeu_ps(right + i, _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
     }
-    if(pulse_is_stream_ready(self->pulse_record_stream)) {
-        if(!pulse_check_operation(pa_stream_set_buffer_attr(self->pulse_record_stream, &record_buffer_attr, nullptr, nullptr))) {
-            pulse_throw_exception(self->pulse_context, "Unable to reset PulseAudio record buffer");
+    for(; i < nframes; ++i) {
+        left[i] = src[2 * i];
+        right[i] = src[2 * i + 1];
+    }
+}
+
+// Eight channels are two 4x4 transposes per four frames
+__attribute__((target("sse2")))
+void JopaKernels::interleave_octo_sse2(float* dst, float* const* src, unsigned, size_t offset, size_t nframes) {
+    size_t i = 0;
+    for(; i + 4 <= nframes; i += 4) {
+        for(unsigned half = 0; half < 2; ++half) {
+            __m128 a = _mm_loadu_ps(src[half * 4] + offset + i);
+            __m128 b = _mm_loadu_ps(src[half * 4 + 1] + offset + i);
+            __m128 c = _mm_loadu_ps(src[half * 4 + 2] + offset + i);
+            __m128 d = _mm_loadu_ps(src[half * 4 + 3] + offset + i);
+            _MM_TRANSPOSE4_PS(a, b, c, d);
+            float* frame = dst + i * 8 + half * 4;
+            _mm_storeu_ps(frame, a);
+            _mm_storeu_ps(frame + 8, b);
+            _mm_storeu_ps(frame + 16, c);
+            _mm_storeu_ps(frame + 24, d);
         }
     }
-    if(pulse_is_stream_ready(self->pulse_monitor_stream)) {
-        if(!pulse_check_operation(pa_stream_set_buffer_attr(self->pulse_monitor_stream, &record_buffer_attr, nullptr, nullptr))) {
-            pulse_throw_exception(self->pulse_context, "Unable to reset PulseAudio monitor buffer");
+    for(; i < nframes; ++i) {
+        for(unsigned ch = 0; ch < 8; ++ch) {
+            dst[i * 8 + ch] = src[ch][offset + i];
         }
     }
+}
 
-    // Reset JACK ringbuffer
-    {
-        PulseThreadedMainloopLocker locker(self->pulse_mainloop);
-        jack_ringbuffer_free(self->jack_playback_ringbuffer);
-        self->jack_playback_ringbuffer = jack_ringbuffer_create(self->jack_buffer_size * (num_channels * sizeof (pulse_sample_t) * ringbuffer_fragments));
-        if(self->jack_playback_ringbuffer == nullptr) {
-            throw std::runtime_error("Unable to create JACK playback buffer");
-        }
-        jack_ringbuffer_free(self->jack_capture_ringbuffer);
-        self->jack_capture_ringbuffer = jack_ringbuffer_create(self->jack_buffer_size * (num_channels * sizeof (pulse_sample_t) * ringbuffer_fragments));
-        if(self->jack_capture_ringbuffer == nullptr) {
-            throw std::runtime_error("Unable to create JACK capture buffer");
+__attribute__((target("sse2")))
+void JopaKernels::deinterleave_octo_sse2(float* const* dst, float const* src, unsigned, size_t offset, size_t nframes) {
+    size_t i = 0;
+    for(; i + 4 <= nframes; i += 4) {
+        for(unsigned half = 0; half < 2; ++half) {
+            float const* frame = src + i * 8 + half * 4;
+            __m128 a = _mm_loadu_ps(frame);
+            __m128 b = _mm_loadu_ps(frame + 8);
+            __m128 c = _mm_loadu_ps(frame + 16);
+            __m128 d = _mm_loadu_ps(frame + 24);
+            _MM_TRANSPOSE4_PS(a, b, c, d);
+            _mm_storeu_ps(dst[half * 4] + offset + i, a);
+            _mm_storeu_ps(dst[half * 4 + 1] + offset + i, b);
+            _mm_storeu_ps(dst[half * 4 + 2] + offset + i, c);
+            _mm_storeu_ps(dst[half * 4 + 3] + offset + i, d);
         }
-        jack_ringbuffer_free(self->jack_monitor_ringbuffer);
-        self->jack_monitor_ringbuffer = jack_ringbuffer_create(self->jack_buffer_size * (num_channels * sizeof (pulse_sample_t) * ringbuffer_fragments));
-        if(self->jack_monitor_ringbuffer == nullptr) {
-            throw std::runtime_error("Unable to create JACK monitor buffer");
+    }
+    for(; i < nframes; ++i) {
+        for(unsigned ch = 0; ch < 8; ++ch) {
+            dst[ch][offset + i] = src[i * 8 + ch];
         }
     }
+}
 
-    std::fprintf(stderr, "JACK buffer size is %u samples (%.2lf ms).\n", nframes, 1000.0 * nframes / self->sample_rate);
-    std::fprintf(stderr, "JOPA buffer size is %u samples (%.2lf ms).\n", nframes * ringbuffer_fragments, 1000.0 * nframes * ringbuffer_fragments / self->sample_rate);
-    std::fprintf(stderr, "PulseAudio buffer size is %u samples (%.2lf ms).\n", nframes, 1000.0 * nframes / self->sample_rate);
+#endif
 
-    return 0;
+#ifdef JOPA_NEON_KERNELS
+
+void JopaKernels::interleave_stereo_neon(float* dst, float* const* src, unsigned, size_t offset, size_t nframes) {
+    float const* left = src[0] + offset;
+    float const* right = src[1] + offset;
+    size_t i = 0;
+    for(; i + 4 <= nframes; i += 4) {
+        float32x4x2_t frames = {{ vld1q_f32(left + i), vld1q_f32(right + i) }};
+        vst2q_f32(dst + 2 * i, frames);
+    }
+    for(; i < nframes; ++i) {
+        dst[2 * i] = left[i];
+        dst[2 * i + 1] = right[i];
+    }
 }
 
-int JopaSession::jack_on_sample_rate(jack_nframes_t nframes, void* arg) {
-    JopaSession* self = reinterpret_cast<JopaSession*>(arg);
-    PulseThreadedMainloopLocker(self->pulse_mainloop);
+void JopaKernels::deinterleave_stereo_neon(float* const* dst, float const* src, unsigned, size_t offset, size_t nframes) {
+    float* left = dst[0] + offset;
+    float* right = dst[1] + offset;
+    size_t i = 0;
+    for(; i + 4 <= nframes; i += 4) {
+        float32x4x2_t frames = vld2q_f32(src + 2 * i);
+        vst1q_f32(left + i, frames.val[0]);
+        vst1q_f32(right + i, frames.val[1]);
+    }
+    for(; i < nframes; ++i) {
+        left[i] = src[2 * i];
+        right[i] = src[2 * i + 1];
+    }
+}
 
-    // Reset PulseAudio streams
-    self->sample_rate = nframes;
-    if(pulse_is_stream_ready(self->pulse_playback_stream)) {
-        if(!pulse_check_operation(pa_stream_update_sample_rate(self->pulse_playback_stream, nframes, nullptr, nullptr))) {
-            pulse_throw_exception(self->pulse_context, "Unable to reset PulseAudio playback sample rate");
+#endif
+
+size_t const JopaVariants::test_lengths[16] = { 0, 1, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 33, 64, 255, 1023 };
+
+template<typename T, typename Verify>
+T JopaVariants::select(T const& reference, T const* candidates, unsigned num_candidates, char const* kind, Verify verify) {
+    for(unsigned i = 0; i < num_candidates; ++i) {
+        if(verify(candidates[i], reference)) {
+            return candidates[i];
         }
+        std::fprintf(stderr, "%s %s failed verification, not using it\n", candidates[i].name, kind);
     }
-    if(pulse_is_stream_ready(self->pulse_record_stream)) {
-        if(!pulse_check_operation(pa_stream_update_sample_rate(self->pulse_record_stream, nframes, nullptr, nullptr))) {
-            pulse_throw_exception(self->pulse_context, "Unable to reset PulseAudio record sample rate");
+    return reference;
+}
+
+JopaKernels JopaKernels::select(unsigned channels) {
+    JopaKernels scalar = { "generic scalar", interleave_scalar, deinterleave_scalar };
+    JopaKernels candidates[4];
+    unsigned num_candidates = 0;
+
+    switch(channels) {
+    case 1:
+        candidates[num_candidates++] = { "mono", interleave_fixed<1>, deinterleave_fixed<1> };
+        break;
+    case 2:
+#ifdef JOPA_X86_KERNELS
+        if(__builtin_cpu_supports("avx2")) {
+            candidates[num_candidates++] = { "AVX2 stereo", interleave_stereo_avx2, deinterleave_stereo_avx2 };
         }
-    }
-    if(pulse_is_stream_ready(self->pulse_monitor_stream)) {
-        if(!pulse_check_operation(pa_stream_update_sample_rate(self->pulse_monitor_stream, nframes, nullptr, nullptr))) {
-            pulse_throw_exception(self->pulse_context, "Unable to reset PulseAudio monitor sample rate");
+        if(__builtin_cpu_supports("sse2")) {
+            candidates[num_candidates++] = { "SSE2 stereo", interleave_stereo_sse2, deinterleave_stereo_sse2 };
+        }
+#endif
+#ifdef JOPA_NEON_KERNELS
+        candidates[num_candidates++] = { "NEON stereo", interleave_stereo_neon, deinterleave_stereo_neon };
+#endif
+        candidates[num_candidates++] = { "scalar stereo", interleave_fixed<2>, deinterleave_fixed<2> };
+        break;
+    case 6:
+        candidates[num_candidates++] = { "scalar 6-channel", interleave_fixed<6>, deinterleave_fixed<6> };
+        break;
+    case 8:
+#ifdef JOPA_X86_KERNELS
+        if(__builtin_cpu_supports("sse2")) {
+            candidates[num_candidates++] = { "SSE2 8-channel", interleave_octo_sse2, deinterleave_octo_sse2 };
         }
+#endif
+        candidates[num_candidates++] = { "scalar 8-channel", interleave_fixed<8>, deinterleave_fixed<8> };
+        break;
     }
 
-    std::fprintf(stderr, "Sample rate is %u Hz.\n", nframes);
-
-    return 0;
+    return JopaVariants::select(scalar, candidates, num_candidates, "sample kernels", [channels](JopaKernels const& candidate, JopaKernels const& reference) {
+        return verify(candidate, reference, channels);
+    });
 }
 
-void JopaSession::jack_on_port_connect(jack_port_id_t a, jack_port_id_t b, int connect, void* arg) {
-    JopaSession* self = reinterpret_cast<JopaSession*>(arg);
-
-    jack_port_t* port_a = jack_port_by_id(self->jack_client, a);
-    jack_port_t* port_b = jack_port_by_id(self->jack_client, b);
-
-    char const* port_name_a = jack_port_name(port_a);
-    char const* port_name_b = jack_port_name(port_b);
+bool JopaKernels::verify(JopaKernels const& candidate, JopaKernels const& reference, unsigned channels) {
+    // Offsets move the vector body against the buffers as well
+    static size_t const test_offsets[] = { 0, 1, 3, 8 };
+    static size_t const max_nframes = JopaVariants::max_test_length + 8;
 
-    char const* port_short_name_a = jack_port_short_name(port_a);
-    char const* port_short_name_b = jack_port_short_name(port_b);
+    std::vector<float> planar(channels * max_nframes);
+    std::vector<float> interleaved(channels * max_nframes);
+    std::vector<float> expected(channels * max_nframes);
+    std::vector<float*> planar_ptrs(channels);
+    std::vector<float*> expected_ptrs(channels);
+    for(size_t i = 0; i < planar.size(); ++i) {
+        planar[i] = (float) i * 0.5f - 1000.0f;
+        interleaved[i] = -(float) i * 0.25f;
+    }
 
-    // Search for system:capture ports
-    if(std::strncmp(port_name_a, "system:", 7) == 0) {
-        for(unsigned ch = 0; ch < num_channels; ++ch) {
-            if(std::strcmp(jack_port_short_name(self->jack_capture_ports[ch]), port_short_name_a) == 0) {
-                self->jack_schedule_connect(jack_port_name(self->jack_capture_ports[ch]), port_name_b, connect);
-                break;
+    for(size_t nframes : JopaVariants::test_lengths) {
+        for(size_t offset : test_offsets) {
+            for(unsigned ch = 0; ch < channels; ++ch) {
+                planar_ptrs[ch] = &planar[ch * max_nframes];
+                expected_ptrs[ch] = &expected[ch * max_nframes];
+            }
+            std::vector<float> actual(channels * max_nframes, 0.0f);
+            expected.assign(channels * max_nframes, 0.0f);
+            candidate.interleave(actual.data(), planar_ptrs.data(), channels, offset, nframes);
+            reference.interleave(expected.data(), planar_ptrs.data(), channels, offset, nframes);
+            if(std::memcmp(actual.data(), expected.data(), actual.size() * sizeof (float)) != 0) {
+                return false;
             }
-        }
-    }
 
-    // Search for system:playback ports
-    if(std::strncmp(port_name_b, "system:", 7) == 0) {
-        for(unsigned ch = 0; ch < num_channels; ++ch) {
-            if(std::strcmp(jack_port_short_name(self->jack_playback_ports[ch]), port_short_name_b) == 0) {
-                self->jack_schedule_connect(port_name_a, jack_port_name(self->jack_playback_ports[ch]), connect);
-                break;
+            std::vector<float> actual_planar(channels * max_nframes, 0.0f);
+            std::vector<float*> actual_ptrs(channels);
+            for(unsigned ch = 0; ch < channels; ++ch) {
+                actual_ptrs[ch] = &actual_planar[ch * max_nframes];
+            }
+            expected.assign(channels * max_nframes, 0.0f);
+            candidate.deinterleave(actual_ptrs.data(), interleaved.data(), channels, offset, nframes);
+            reference.deinterleave(expected_ptrs.data(), interleaved.data(), channels, offset, nframes);
+            if(std::memcmp(actual_planar.data(), expected.data(), actual_planar.size() * sizeof (float)) != 0) {
+                return false;
             }
         }
     }
+    return true;
+}
 
-    if(connect) {
-        std::fprintf(stderr, "%s =====> %s\n", port_name_a, port_name_b);
-    } else {
-        std::fprintf(stderr, "%s ==X==> %s\n", port_name_a, port_name_b);
+void JopaConverter::seed(DitherState* dither, uint32_t seed) {
+    for(unsigned lane = 0; lane < dither_lanes; ++lane) {
+        // xorshift32 must not start at zero
+        dither->lanes[lane] = (seed + lane + 1) * 2654435761u | 1;
     }
-
 }
 
-void JopaSession::jack_on_error(char const* reason) {
-    std::fprintf(stderr, "JACK error: %s\n", reason);
+// The scalar variants spell out min/max the way SSE does, so NaN and
+// out-of-range samples clamp identically
+void JopaConverter::encode_s16_scalar(void* dst, float const* src, size_t nsamples, DitherState* dither, float dither_scale) {
+    int16_t* out = reinterpret_cast<int16_t*>(dst);
+    for(size_t i = 0; i < nsamples; ++i) {
+        uint32_t x = dither->lanes[i % dither_lanes];
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        dither->lanes[i % dither_lanes] = x;
+        // Sum of two uniform variables is triangular, in (-1, 1) LSB
+        float d = ((float) (int32_t) ((x & 0xffff) + (x >> 16)) * (1.0f / 65536) - 1.0f) * dither_scale;
+        float v = src[i] * 32768.0f + d;
+        v = v < 32767.0f ? v : 32767.0f;
+        v = v > -32768.0f ? v : -32768.0f;
+        out[i] = (int16_t) std::lrint(v);
+    }
 }
 
-void JopaSession::pulse_on_context_state(pa_context* c, void* userdata) {
-    JopaSession* self = reinterpret_cast<JopaSession*>(userdata);
-
-    switch(pa_context_get_state(c)) {
-    case PA_CONTEXT_READY:
-        break;
-    case PA_CONTEXT_FAILED:
-        pulse_throw_exception(c, "Unable to connect to the PulseAudio server");
-        return;
-    case PA_CONTEXT_TERMINATED:
-        std::exit(0);
-        return;
-    default:
-        return;
+void JopaConverter::decode_s16_scalar(float* dst, void const* src, size_t nsamples) {
+    int16_t const* in = reinterpret_cast<int16_t const*>(src);
+    for(size_t i = 0; i < nsamples; ++i) {
+        dst[i] = (float) in[i] * (1.0f / 32768);
     }
+}
 
-    // Create streams
-    pa_sample_spec sample_spec = self->pulse_calc_sample_spec();
-    self->pulse_playback_stream = pa_stream_new(c, "JACK playback", &sample_spec, nullptr);
-    if(self->pulse_playback_stream == nullptr) {
-        pulse_throw_exception(c, "Unable to create a PulseAudio playback stream");
-    }
-    self->pulse_record_stream = pa_stream_new(c, "JACK record", &sample_spec, nullptr);
-    if(self->pulse_record_stream == nullptr) {
-        pulse_throw_exception(c, "Unable to create a PulseAudio playback stream");
+void JopaConverter::encode_s32_scalar(void* dst, float const* src, size_t nsamples, DitherState*, float) {
+    // A float mantissa is shorter than 32 bits, nothing to dither
+    int32_t* out = reinterpret_cast<int32_t*>(dst);
+    for(size_t i = 0; i < nsamples; ++i) {
+        float v = src[i] * 2147483648.0f;
+        v = v < 2147483520.0f ? v : 2147483520.0f;
+        v = v > -2147483648.0f ? v : -2147483648.0f;
+        out[i] = (int32_t) std::lrint(v);
     }
-    self->pulse_monitor_stream = pa_stream_new(c, "JACK monitor", &sample_spec, nullptr);
-    if(self->pulse_monitor_stream == nullptr) {
-        pulse_throw_exception(c, "Unable to create a PulseAudio monitor stream");
+}
+
+void JopaConverter::decode_s32_scalar(float* dst, void const* src, size_t nsamples) {
+    int32_t const* in = reinterpret_cast<int32_t const*>(src);
+    for(size_t i = 0; i < nsamples; ++i) {
+        dst[i] = (float) in[i] * (1.0f / 2147483648.0f);
     }
+}
 
-    // Set stream read/write callback
-    pa_stream_set_write_callback(self->pulse_playback_stream, pulse_on_playback_writable, self);
-    pa_stream_set_read_callback(self->pulse_record_stream, pulse_on_record_readable, self);
-    pa_stream_set_read_callback(self->pulse_monitor_stream, pulse_on_monitor_readable, self);
+#ifdef JOPA_X86_KERNELS
 
-    // A move operation resets the stream's buffer attributes
-    // Use a callback to detect the change
-    pa_stream_set_moved_callback(self->pulse_playback_stream, pulse_on_playback_stream_moved, self);
-    pa_stream_set_moved_callback(self->pulse_record_stream, pulse_on_record_stream_moved, self);
-    pa_stream_set_moved_callback(self->pulse_monitor_stream, pulse_on_record_stream_moved, self);
+__attribute__((target("sse2")))
+static inline __m128 jopa_dither_sse2(__m128i& state, __m128 scale) {
+    state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+    state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+    state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+    __m128i sum = _mm_add_epi32(_mm_and_si128(state, _mm_set1_epi32(0xffff)), _mm_srli_epi32(state, 16));
+    return _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(sum), _mm_set1_ps(1.0f / 65536)), _mm_set1_ps(1.0f)), scale);
+}
 
-    // Connect play & record streams
-    pa_buffer_attr playback_buffer_attr = self->pulse_calc_buffer_attr(false);
-    pa_buffer_attr record_buffer_attr = self->pulse_calc_buffer_attr(true);
-    if(pa_stream_connect_playback(self->pulse_playback_stream, nullptr, &playback_buffer_attr, (pa_stream_flags_t) (PA_STREAM_VARIABLE_RATE | PA_STREAM_ADJUST_LATENCY), nullptr, nullptr) < 0) {
-        pulse_throw_exception(c, "Unable to connect to PulseAudio playback stream");
-    }
-    if(pa_stream_connect_record(self->pulse_record_stream, nullptr, &record_buffer_attr, (pa_stream_flags_t) (PA_STREAM_VARIABLE_RATE | PA_STREAM_ADJUST_LATENCY)) < 0) {
-        pulse_throw_exception(c, "Unable to connect to PulseAudio record stream");
+__attribute__((target("sse2")))
+void JopaConverter::encode_s16_sse2(void* dst, float const* src, size_t nsamples, DitherState* dither, float dither_scale) {
+    int16_t* out = reinterpret_cast<int16_t*>(dst);
+    __m128i state_a = _mm_loadu_si128((__m128i const*) &dither->lanes[0]);
+    __m128i state_b = _mm_loadu_si128((__m128i const*) &dither->lanes[4]);
+    __m128 scale = _mm_set1_ps(dither_scale);
+    __m128 gain = _mm_set1_ps(32768.0f);
+    __m128 high = _mm_set1_ps(32767.0f);
+    __m128 low = _mm_set1_ps(-32768.0f);
+    size_t i = 0;
+    for(; i + 8 <= nsamples; i += 8) {
+        __m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i), gain), jopa_dither_sse2(state_a, scale));
+        __m128 b = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), gain), jopa_dither_sse2(state_b, scale));
+        a = _mm_max_ps(_mm_min_ps(a, high), low);
+        b = _mm_max_ps(_mm_min_ps(b, high), low);
+        _mm_storeu_si128((__m128i*) (out + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
     }
+    _mm_storeu_si128((__m128i*) &dither->lanes[0], state_a);
+    _mm_storeu_si128((__m128i*) &dither->lanes[4], state_b);
+    // i is a multiple of dither_lanes, so the remainder keeps the lane assignment
+    encode_s16_scalar(out + i, src + i, nsamples - i, dither, dither_scale);
+}
 
-    // Prepare monitor stream
-    uint32_t play_device_index = pa_stream_get_device_index(self->pulse_playback_stream);
-    if(!pulse_check_operation(pa_context_get_sink_info_by_index(c, play_device_index, pulse_on_get_sink_info, self))) {
-        pulse_throw_exception(c, "Unable to query PulseAudio for sink information");
+__attribute__((target("sse2")))
+void JopaConverter::decode_s16_sse2(float* dst, void const* src, size_t nsamples) {
+    int16_t const* in = reinterpret_cast<int16_t const*>(src);
+    __m128 gain = _mm_set1_ps(1.0f / 32768);
+    size_t i = 0;
+    for(; i + 8 <= nsamples; i += 8) {
+        __m128i x = _mm_loadu_si128((__m128i const*) (in + i));
+        // Sign extend by moving each sample to the top half and shifting back
+        __m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(a), gain));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(b), gain));
     }
+    decode_s16_scalar(dst + i, in + i, nsamples - i);
 }
 
-void JopaSession::pulse_on_playback_writable(pa_stream* p, size_t nbytes, void* userdata) {
-    JopaSession* self = reinterpret_cast<JopaSession*>(userdata);
-
-    pulse_sample_t* data;
-    size_t nbytes_readable = jack_ringbuffer_read_space(self->jack_playback_ringbuffer);
-    size_t nbytes_writable = nbytes;
-    if(pa_stream_begin_write(self->pulse_playback_stream, (void**) &data, &nbytes_writable) < 0) {
-        pulse_throw_exception(self->pulse_context, "Unable to write to PulseAudio playback buffer");
+__attribute__((target("avx2")))
+void JopaConverter::encode_s16_avx2(void* dst, float const* src, size_t nsamples, DitherState* dither, float dither_scale) {
+    int16_t* out = reinterpret_cast<int16_t*>(dst);
+    __m256i state = _mm256_loadu_si256((__m256i const*) dither->lanes);
+    __m256 scale = _mm256_set1_ps(dither_scale);
+    __m256 gain = _mm256_set1_ps(32768.0f);
+    __m256 high = _mm256_set1_ps(32767.0f);
+    __m256 low = _mm256_set1_ps(-32768.0f);
+    size_t i = 0;
+    for(; i + 8 <= nsamples; i += 8) {
+        state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 13));
+        state = _mm256_xor_si256(state, _mm256_srli_epi32(state, 17));
+        state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 5));
+        __m256i sum = _mm256_add_epi32(_mm256_and_si256(state, _mm256_set1_epi32(0xffff)), _mm256_srli_epi32(state, 16));
+        __m256 d = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(sum), _mm256_set1_ps(1.0f / 65536)), _mm256_set1_ps(1.0f)), scale);
+        __m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i), gain), d);
+        v = _mm256_max_ps(_mm256_min_ps(v, high), low);
+        __m256i x = _mm256_cvtps_epi32(v);
+        _mm_storeu_si128((__m128i*) (out + i), _mm_packs_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1)));
     }
-    if(nbytes_readable >= nbytes_writable) {
-        jack_ringbuffer_read(self->jack_playback_ringbuffer, (char*) data, nbytes_writable);
-    } else {
-        std::memset(data, 0, nbytes_writable);
-        std::fprintf(stderr, "Playback buffer underflow: %zu < %zu\n", nbytes_readable, nbytes_writable);
+    _mm256_storeu_si256((__m256i*) dither->lanes, state);
+    encode_s16_scalar(out + i, src + i, nsamples - i, dither, dither_scale);
+}
+
+__attribute__((target("sse2")))
+void JopaConverter::encode_s32_sse2(void* dst, float const* src, size_t nsamples, DitherState* dither, float dither_scale) {
+    int32_t* out = reinterpret_cast<int32_t*>(dst);
+    __m128 gain = _mm_set1_ps(2147483648.0f);
+    __m128 high = _mm_set1_ps(2147483520.0f);
+    __m128 low = _mm_set1_ps(-2147483648.0f);
+    size_t i = 0;
+    for(; i + 4 <= nsamples; i += 4) {
+        __m128 v = _mm_mul_ps(_mm_loadu_ps(src + i), gain);
+        v = _mm_max_ps(_mm_min_ps(v, high), low);
+        _mm_storeu_si128((__m128i*) (out + i), _mm_cvtps_epi32(v));
     }
-    if(pa_stream_write(self->pulse_playback_stream, data, nbytes_writable, nullptr, 0, PA_SEEK_RELATIVE) < 0) {
-        pulse_throw_exception(self->pulse_context, "Unable to write to PulseAudio playback buffer");
+    encode_s32_scalar(out + i, src + i, nsamples - i, dither, dither_scale);
+}
+
+__attribute__((target("sse2")))
+void JopaConverter::decode_s32_sse2(float* dst, void const* src, size_t nsamples) {
+    int32_t const* in = reinterpret_cast<int32_t const*>(src);
+    __m128 gain = _mm_set1_ps(1.0f / 2147483648.0f);
+    size_t i = 0;
+    for(; i + 4 <= nsamples; i += 4) {
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((__m128i const*) (in + i))), gain));
     }
+    decode_s32_scalar(dst + i, in + i, nsamples - i);
 }
 
-void JopaSession::pulse_on_record_readable(pa_stream* p, size_t, void* userdata) {
-    JopaSession* self = reinterpret_cast<JopaSession*>(userdata);
+#endif
 
-    while(pa_stream_readable_size(p) > 0) {
-        pulse_sample_t const* data;
-        size_t nbytes_readable;
-        if(pa_stream_peek(p, (void const**) &data, &nbytes_readable) < 0) {
-            pulse_throw_exception(self->pulse_context, "Unable to read from PulseAudio record buffer");
+JopaConverter JopaConverter::select(pa_sample_format_t format) {
+    JopaConverter scalar;
+    JopaConverter candidates[2];
+    unsigned num_candidates = 0;
+
+    if(format == PA_SAMPLE_S16NE) {
+        scalar = { "scalar 16-bit", sizeof (int16_t), encode_s16_scalar, decode_s16_scalar };
+#ifdef JOPA_X86_KERNELS
+        if(__builtin_cpu_supports("avx2")) {
+            candidates[num_candidates++] = { "AVX2 16-bit", sizeof (int16_t), encode_s16_avx2, decode_s16_sse2 };
         }
-        if(data != nullptr) {
-            size_t nbytes_writable = jack_ringbuffer_write_space(self->jack_capture_ringbuffer);
-            if(nbytes_writable >= nbytes_readable) {
-                jack_ringbuffer_write(self->jack_capture_ringbuffer, (char const*) data, nbytes_readable);
-            } else {
-                std::fprintf(stderr, "Record buffer overflow: %zu < %zu\n", nbytes_writable, nbytes_readable);
-            }
-            if(pa_stream_drop(p) < 0) {
-                pulse_throw_exception(self->pulse_context, "Unable to read from PulseAudio record buffer");
-            }
-        } else if(nbytes_readable != 0) {
-            std::fprintf(stderr, "Record buffer overflow: %zu bytes hole\n", nbytes_readable);
-            if(pa_stream_drop(p) < 0) {
-                pulse_throw_exception(self->pulse_context, "Unable to read from PulseAudio record buffer");
-            }
+        if(__builtin_cpu_supports("sse2")) {
+            candidates[num_candidates++] = { "SSE2 16-bit", sizeof (int16_t), encode_s16_sse2, decode_s16_sse2 };
+        }
+#endif
+    } else {
+        scalar = { "scalar 32-bit", sizeof (int32_t), encode_s32_scalar, decode_s32_scalar };
+#ifdef JOPA_X86_KERNELS
+        if(__builtin_cpu_supports("sse2")) {
+            candidates[num_candidates++] = { "SSE2 32-bit", sizeof (int32_t), encode_s32_sse2, decode_s32_sse2 };
         }
+#endif
     }
+
+    return JopaVariants::select(scalar, candidates, num_candidates, "sample converter", verify);
 }
 
-void JopaSession::pulse_on_monitor_readable(pa_stream* p, size_t, void* userdata) {
-    JopaSession* self = reinterpret_cast<JopaSession*>(userdata);
+bool JopaConverter::verify(JopaConverter const& candidate, JopaConverter const& reference) {
+    static size_t const max_nsamples = JopaVariants::max_test_length;
 
-    while(pa_stream_readable_size(p) > 0) {
-        pulse_sample_t const* data;
-        size_t nbytes_readable;
-        if(pa_stream_peek(p, (void const**) &data, &nbytes_readable) < 0) {
-            pulse_throw_exception(self->pulse_context, "Unable to read from PulseAudio monitor buffer");
-        }
-        if(data != nullptr) {
-            size_t nbytes_writable = jack_ringbuffer_write_space(self->jack_monitor_ringbuffer);
-            if(nbytes_writable >= nbytes_readable) {
-                jack_ringbuffer_write(self->jack_monitor_ringbuffer, (char const*) data, nbytes_readable);
-            } else {
-                std::fprintf(stderr, "Monitor buffer overflow: %zu < %zu\n", nbytes_writable, nbytes_readable);
-            }
-            if(pa_stream_drop(p) < 0) {
-                pulse_throw_exception(self->pulse_context, "Unable to read from PulseAudio monitor buffer");
+    // Full scale, beyond full scale, tiny values and ties
+    std::vector<float> samples(max_nsamples);
+    for(size_t i = 0; i < max_nsamples; ++i) {
+        samples[i] = std::sin((float) i * 0.37f) * 1.25f + ((i % 5 == 0) ? 0.5f / 32768 : 0.0f);
+    }
+    std::vector<char> actual(max_nsamples * candidate.sample_size);
+    std::vector<char> expected(max_nsamples * reference.sample_size);
+    std::vector<float> actual_decoded(max_nsamples);
+    std::vector<float> expected_decoded(max_nsamples);
+
+    for(float dither_scale : { 0.0f, 1.0f }) {
+        DitherState actual_dither;
+        DitherState expected_dither;
+        seed(&actual_dither, 1);
+        seed(&expected_dither, 1);
+        for(size_t nsamples : JopaVariants::test_lengths) {
+            std::fill(actual.begin(), actual.end(), 0);
+            std::fill(expected.begin(), expected.end(), 0);
+            candidate.encode(actual.data(), samples.data(), nsamples, &actual_dither, dither_scale);
+            reference.encode(expected.data(), samples.data(), nsamples, &expected_dither, dither_scale);
+            if(actual != expected || std::memcmp(&actual_dither, &expected_dither, sizeof (DitherState)) != 0) {
+                return false;
             }
-        } else if(nbytes_readable != 0) {
-            std::fprintf(stderr, "Monitor buffer overflow: %zu bytes hole\n", nbytes_readable);
-            if(pa_stream_drop(p) < 0) {
-                pulse_throw_exception(self->pulse_context, "Unable to read from PulseAudio monitor buffer");
+
+            std::fill(actual_decoded.begin(), actual_decoded.end(), 0.0f);
+            std::fill(expected_decoded.begin(), expected_decoded.end(), 0.0f);
+            candidate.decode(actual_decoded.data(), expected.data(), nsamples);
+            reference.decode(expected_decoded.data(), expected.data(), nsamples);
+            if(std::memcmp(actual_decoded.data(), expected_decoded.data(), max_nsamples * sizeof (float)) != 0) {
+                return false;
             }
         }
     }
+    return true;
 }
 
-void JopaSession::pulse_on_playback_stream_moved(pa_stream* p, void* userdata) {
-    JopaSession* self = reinterpret_cast<JopaSession*>(userdata);
-
-    // Reset buffer attributes
-    pa_buffer_attr playback_buffer_attr = self->pulse_calc_buffer_attr(false);
-    if(pulse_is_stream_ready(p)) {
-        if(!pulse_check_operation(pa_stream_set_buffer_attr(p, &playback_buffer_attr, nullptr, nullptr))) {
-            pulse_throw_exception(self->pulse_context, "Unable to reset PulseAudio playback buffer");
-        }
+float JopaMeter::peak_scalar(float const* src, size_t nframes) {
+    float peak = 0;
+    for(size_t i = 0; i < nframes; ++i) {
+        float level = std::fabs(src[i]);
+        peak = level > peak ? level : peak;
     }
+    return peak;
 }
 
-void JopaSession::pulse_on_record_stream_moved(pa_stream* p, void* userdata) {
-    JopaSession* self = reinterpret_cast<JopaSession*>(userdata);
+JopaMeter::Level JopaMeter::finish_level(float peak, float const* lanes, float const* tail, size_t tail_nframes) {
+    // Fewer than eight samples are left over, they get summed on their own
+    float rest = 0;
+    for(size_t i = 0; i < tail_nframes; ++i) {
+        rest += tail[i] * tail[i];
+    }
+    float energy = ((lanes[0] + lanes[4]) + (lanes[2] + lanes[6])) + ((lanes[1] + lanes[5]) + (lanes[3] + lanes[7]));
+    return { peak, energy + rest };
+}
 
-    // Reset buffer attributes
-    pa_buffer_attr record_buffer_attr = self->pulse_calc_buffer_attr(true);
-    if(pulse_is_stream_ready(p)) {
-        if(!pulse_check_operation(pa_stream_set_buffer_attr(p, &record_buffer_attr, nullptr, nullptr))) {
-            pulse_throw_exception(self->pulse_context, "Unable to reset PulseAudio record / monitor buffer");
+JopaMeter::Level JopaMeter::level_scalar(float const* src, size_t nframes) {
+    float lanes[8] = { 0 };
+    size_t i = 0;
+    for(; i + 8 <= nframes; i += 8) {
+        for(size_t lane = 0; lane < 8; ++lane) {
+            lanes[lane] += src[i + lane] * src[i + lane];
         }
     }
+    return finish_level(peak_scalar(src, nframes), lanes, src + i, nframes - i);
 }
 
-void JopaSession::pulse_on_get_sink_info(pa_context* c, pa_sink_info const* i, int eol, void* userdata) {
-    JopaSession* self = reinterpret_cast<JopaSession*>(userdata);
+#ifdef JOPA_X86_KERNELS
 
-    if(eol < 0) {
-        pulse_throw_exception(c, "Unable to get PulseAudio sink info");
+// maxps returns its second operand if either is NaN, which keeps NaN out like the scalar code
+__attribute__((target("sse2")))
+float JopaMeter::peak_sse2(float const* src, size_t nframes) {
+    __m128 magnitude = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 a = _mm_setzero_ps();
+    __m128 b = _mm_setzero_ps();
+    size_t i = 0;
+    for(; i + 8 <= nframes; i += 8) {
+        a = _mm_max_ps(_mm_and_ps(_mm_loadu_ps(src + i), magnitude), a);
+        b = _mm_max_ps(_mm_and_ps(_mm_loadu_ps(src + i + 4), magnitude), b);
     }
-    if(i == nullptr) {
-        return;
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_max_ps(a, b));
+    float peak = peak_scalar(src + i, nframes - i);
+    for(float level : lanes) {
+        peak = level > peak ? level : peak;
     }
+    return peak;
+}
 
-    // Connect monitor stream
-    pa_buffer_attr monitor_buffer_attr = self->pulse_calc_buffer_attr(true);
-    if(pa_stream_connect_record(self->pulse_monitor_stream, i->monitor_source_name, &monitor_buffer_attr, (pa_stream_flags_t) (PA_STREAM_VARIABLE_RATE | PA_STREAM_ADJUST_LATENCY)) < 0) {
-        pulse_throw_exception(c, "Unable to connect to PulseAudio monitor stream");
+__attribute__((target("sse2")))
+JopaMeter::Level JopaMeter::level_sse2(float const* src, size_t nframes) {
+    __m128 magnitude = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 peak_a = _mm_setzero_ps();
+    __m128 peak_b = _mm_setzero_ps();
+    __m128 energy_a = _mm_setzero_ps();
+    __m128 energy_b = _mm_setzero_ps();
+    size_t i = 0;
+    for(; i + 8 <= nframes; i += 8) {
+        __m128 x = _mm_loadu_ps(src + i);
+        __m128 y = _mm_loadu_ps(src + i + 4);
+        peak_a = _mm_max_ps(_mm_and_ps(x, magnitude), peak_a);
+        peak_b = _mm_max_ps(_mm_and_ps(y, magnitude), peak_b);
+        energy_a = _mm_add_ps(energy_a, _mm_mul_ps(x, x));
+        energy_b = _mm_add_ps(energy_b, _mm_mul_ps(y, y));
+    }
+    float peaks[4];
+    _mm_storeu_ps(peaks, _mm_max_ps(peak_a, peak_b));
+    float peak = peak_scalar(src + i, nframes - i);
+    for(float level : peaks) {
+        peak = level > peak ? level : peak;
     }
+    float lanes[8];
+    _mm_storeu_ps(lanes, energy_a);
+    _mm_storeu_ps(lanes + 4, energy_b);
+    return finish_level(peak, lanes, src + i, nframes - i);
 }
 
-void JopaSession::jack_schedule_connect(char const* port_name_a, char const* port_name_b, bool connect) {
-    JackConnectOperation operation = {
-        .port_name_a = port_name_a,
-        .port_name_b = port_name_b,
-        .connect = connect
-    };
-    jack_connect_operations.push(std::move(operation));
+__attribute__((target("avx2")))
+float JopaMeter::peak_avx2(float const* src, size_t nframes) {
+    __m256 magnitude = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 a = _mm256_setzero_ps();
+    __m256 b = _mm256_setzero_ps();
+    size_t i = 0;
+    for(; i + 16 <= nframes; i += 16) {
+        a = _mm256_max_ps(_mm256_and_ps(_mm256_loadu_ps(src + i), magnitude), a);
+        b = _mm256_max_ps(_mm256_and_ps(_mm256_loadu_ps(src + i + 8), magnitude), b);
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_max_ps(a, b));
+    float peak = peak_scalar(src + i, nframes - i);
+    for(float level : lanes) {
+        peak = level > peak ? level : peak;
+    }
+    return peak;
 }
 
-void JopaSession::jack_finish_connect() {
-    while(!jack_connect_operations.empty()) {
-        JackConnectOperation const& operation = jack_connect_operations.front();
-        if(operation.connect) {
-            jack_connect(jack_client, operation.port_name_a.c_str(), operation.port_name_b.c_str());
-        } else {
-            jack_disconnect(jack_client, operation.port_name_a.c_str(), operation.port_name_b.c_str());
-        }
-        jack_connect_operations.pop();
+__attribute__((target("avx2")))
+JopaMeter::Level JopaMeter::level_avx2(float const* src, size_t nframes) {
+    __m256 magnitude = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 peak_a = _mm256_setzero_ps();
+    __m256 energy = _mm256_setzero_ps();
+    size_t i = 0;
+    for(; i + 8 <= nframes; i += 8) {
+        __m256 x = _mm256_loadu_ps(src + i);
+        peak_a = _mm256_max_ps(_mm256_and_ps(x, magnitude), peak_a);
+        // No FMA, its single rounding would differ from the other variants
+        energy = _mm256_add_ps(energy, _mm256_mul_ps(x, x));
     }
+    float peaks[8];
+    _mm256_storeu_ps(peaks, peak_a);
+    float peak = peak_scalar(src + i, nframes - i);
+    for(float level : peaks) {
+        peak = level > peak ? level : peak;
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, energy);
+    return finish_level(peak, lanes, src + i, nframes - i);
 }
 
-bool JopaSession::pulse_is_stream_ready(pa_stream* p) {
-    return p != nullptr && pa_stream_get_state(p) == PA_STREAM_READY;
-}
+#endif
 
-bool JopaSession::pulse_check_operation(pa_operation* o) {
-    if(o == nullptr) {
-        return false;
-    } else {
-        pa_operation_unref(o);
-        return true;
+#ifdef JOPA_NEON_KERNELS
+
+// vmaxq_f32 propagates NaN, so select on a comparison instead
+float JopaMeter::peak_neon(float const* src, size_t nframes) {
+    float32x4_t a = vdupq_n_f32(0);
+    float32x4_t b = vdupq_n_f32(0);
+    size_t i = 0;
+    for(; i + 8 <= nframes; i += 8) {
+        float32x4_t x = vabsq_f32(vld1q_f32(src + i));
+        float32x4_t y = vabsq_f32(vld1q_f32(src + i + 4));
+        a = vbslq_f32(vcgtq_f32(x, a), x, a);
+        b = vbslq_f32(vcgtq_f32(y, b), y, b);
+    }
+    float lanes[8];
+    vst1q_f32(lanes, a);
+    vst1q_f32(lanes + 4, b);
+    float peak = peak_scalar(src + i, nframes - i);
+    for(float level : lanes) {
+        peak = level > peak ? level : peak;
     }
+    return peak;
 }
 
-void JopaSession::pulse_throw_exception(pa_context* c, char const* reason) {
-    std::string message(reason);
-    message += ": ";
-    message += pa_strerror(pa_context_errno(c));
-    throw std::runtime_error(message.c_str());
+JopaMeter::Level JopaMeter::level_neon(float const* src, size_t nframes) {
+    float32x4_t peak_a = vdupq_n_f32(0);
+    float32x4_t peak_b = vdupq_n_f32(0);
+    float32x4_t energy_a = vdupq_n_f32(0);
+    float32x4_t energy_b = vdupq_n_f32(0);
+    size_t i = 0;
+    for(; i + 8 <= nframes; i += 8) {
+        float32x4_t x = vld1q_f32(src + i);
+        float32x4_t y = vld1q_f32(src + i + 4);
+        float32x4_t x_abs = vabsq_f32(x);
+        float32x4_t y_abs = vabsq_f32(y);
+        peak_a = vbslq_f32(vcgtq_f32(x_abs, peak_a), x_abs, peak_a);
+        peak_b = vbslq_f32(vcgtq_f32(y_abs, peak_b), y_abs, peak_b);
+        energy_a = vaddq_f32(energy_a, vmulq_f32(x, x));
+        energy_b = vaddq_f32(energy_b, vmulq_f32(y, y));
+    }
+    float peaks[8];
+    vst1q_f32(peaks, peak_a);
+    vst1q_f32(peaks + 4, peak_b);
+    float peak = peak_scalar(src + i, nframes - i);
+    for(float level : peaks) {
+        peak = level > peak ? level : peak;
+    }
+    float lanes[8];
+    vst1q_f32(lanes, energy_a);
+    vst1q_f32(lanes + 4, energy_b);
+    return finish_level(peak, lanes, src + i, nframes - i);
 }
 
-pa_sample_spec JopaSession::pulse_calc_sample_spec() const {
-    pa_sample_spec sample_spec = {
-        .format   = PA_SAMPLE_FLOAT32NE,
-        .rate     = sample_rate,
-        .channels = num_channels
-    };
-    return sample_spec;
-}
+#endif
 
-pa_buffer_attr JopaSession::pulse_calc_buffer_attr(bool record) const {
-    pa_buffer_attr buffer_attr = {
-        .maxlength = (uint32_t) -1,
-        .tlength   = record ? (uint32_t) -1 : (uint32_t) (jack_buffer_size * (num_channels * sizeof (pulse_sample_t))),
-        .prebuf    = (uint32_t) -1,
-        .minreq    = (uint32_t) -1,
-        .fragsize  = record ? (uint32_t) (jack_buffer_size * (num_channels * sizeof (pulse_sample_t))) : (uint32_t) -1
-    };
-    return buffer_attr;
-}
+JopaMeter JopaMeter::select() {
+    JopaMeter scalar = { "scalar", peak_scalar, level_scalar };
+    JopaMeter candidates[2];
+    unsigned num_candidates = 0;
 
-JopaSession::PulseThreadedMainloopLocker::PulseThreadedMainloopLocker(pa_threaded_mainloop* mainloop) {
-    this->mainloop = mainloop;
-    if(mainloop) {
-        pa_threaded_mainloop_lock(mainloop);
+#ifdef JOPA_X86_KERNELS
+    if(__builtin_cpu_supports("avx2")) {
+        candidates[num_candidates++] = { "AVX2", peak_avx2, level_avx2 };
     }
+    if(__builtin_cpu_supports("sse2")) {
+        candidates[num_candidates++] = { "SSE2", peak_sse2, level_sse2 };
+    }
+#endif
+#ifdef JOPA_NEON_KERNELS
+    candidates[num_candidates++] = { "NEON", peak_neon, level_neon };
+#endif
+
+    return JopaVariants::select(scalar, candidates, num_candidates, "level meter", verify);
 }
 
-JopaSession::PulseThreadedMainloopLocker::~PulseThreadedMainloopLocker() {
-    if(mainloop) {
-        pa_threaded_mainloop_unlock(mainloop);
+bool JopaMeter::verify(JopaMeter const& candidate, JopaMeter const& reference) {
+    static size_t const max_nframes = JopaVariants::max_test_length;
+
+    // The peak moves around, so every lane and the remainder get to hold it
+    std::vector<float> samples(max_nframes);
+    for(size_t peak_index = 0; peak_index < 40; ++peak_index) {
+        for(size_t i = 0; i < max_nframes; ++i) {
+            samples[i] = std::sin((float) i * 0.37f) * 0.5f;
+        }
+        samples[peak_index] = peak_index % 2 == 0 ? 0.75f : -0.75f;
+        samples[(peak_index * 7 + 3) % max_nframes] = std::numeric_limits<float>::quiet_NaN();
+        for(size_t nframes : JopaVariants::test_lengths) {
+            float actual = candidate.peak(samples.data(), nframes);
+            float expected = reference.peak(samples.data(), nframes);
+            if(std::memcmp(&actual, &expected, sizeof (float)) != 0) {
+                return false;
+            }
+            Level actual_level = candidate.level(samples.data(), nframes);
+            Level expected_level = reference.level(samples.data(), nframes);
+            if(std::memcmp(&actual_level, &expected_level, sizeof (Level)) != 0) {
+                return false;
+            }
+        }
     }
+    return true;
 }
@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+# Headless loopback latency and soak test, run by "make check".
+#
+# Starts a private jackd on the dummy backend and a private PulseAudio with a
+# null sink, bridges them with jopa, and plays impulses through
+# playback_1 -> null sink -> monitor_1 / capture_1. No sound hardware is needed.
+#
+# Usage: loopback-test.sh [SOAK_SECONDS] [extra jopa-loopback options...]
+# The report goes to stdout as "key value" lines, followed by the statistics of
+# jopa itself; the exit status is non-zero if the test failed.
+
+set -eu
+
+DURATION=${1:-60}
+[ $# -gt 0 ] && shift
+RATE=${RATE:-48000}
+PERIOD=${PERIOD:-1024}
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+WORKDIR=$(mktemp -d)
+PIDS=
+cleanup() {
+    for pid in $PIDS; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+# Keep away from any JACK or PulseAudio server of the user
+export JACK_DEFAULT_SERVER="jopa-test-$$"
+export PULSE_RUNTIME_PATH="$WORKDIR/pulse"
+export PULSE_STATE_PATH="$WORKDIR/pulse"
+export PULSE_SERVER="unix:$WORKDIR/pulse/native"
+mkdir -p "$PULSE_RUNTIME_PATH"
+
+jackd --no-realtime -n "$JACK_DEFAULT_SERVER" -d dummy -r "$RATE" -p "$PERIOD" >"$WORKDIR/jackd.log" 2>&1 &
+PIDS="$PIDS $!"
+
+pulseaudio -n --daemonize=no --exit-idle-time=-1 --use-pid-file=no \
+    -L "module-native-protocol-unix socket=$WORKDIR/pulse/native auth-anonymous=1" \
+    -L "module-null-sink sink_name=jopa_test rate=$RATE" >"$WORKDIR/pulseaudio.log" 2>&1 &
+PIDS="$PIDS $!"
+
+# Both servers take a moment to come up
+i=0
+until pactl info >/dev/null 2>&1 && jack_lsp >/dev/null 2>&1; do
+    i=$((i + 1))
+    if [ $i -gt 50 ]; then
+        echo "Servers did not start, see the logs below" >&2
+        cat "$WORKDIR/jackd.log" "$WORKDIR/pulseaudio.log" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+pactl set-default-sink jopa_test
+pactl set-default-source jopa_test.monitor
+
+"$HERE/jopa" --stats-socket="$WORKDIR/jopa.sock" >"$WORKDIR/jopa.log" 2>&1 &
+PIDS="$PIDS $!"
+
+status=0
+"$HERE/jopa-loopback" --duration="$DURATION" \
+    --return="JACK over PulseAudio:monitor_1" \
+    --return="JACK over PulseAudio:capture_1" "$@" || status=$?
+"$HERE/jopa" --print-stats="$WORKDIR/jopa.sock" | sed 's/^/jopa./' || status=1
+
+if [ $status -ne 0 ]; then
+    echo "Loopback test failed, jopa said:" >&2
+    cat "$WORKDIR/jopa.log" >&2
+fi
+exit $status
@@ -0,0 +1,413 @@
+/*
+    JACK-over-PulseAudio (jopa)
+    Copyright (C) 2013-2017 StarBrilliant <m13253@hotmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Loopback latency and soak test client, driven by loopback-test.sh.
+
+  Sends an impulse into a jopa playback port once per interval and listens
+  for it on the return ports, e.g. the monitor of the sink played to. The
+  round trip must stay below the interval, or impulses get paired up with
+  the wrong arrival.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <unistd.h>
+#include <jack/jack.h>
+#include <jack/ringbuffer.h>
+
+class JopaLoopback {
+
+public:
+
+    struct Options {
+
+        std::string playback_port = "JACK over PulseAudio:playback_1";
+        std::vector<std::string> return_ports;
+        double duration = 60;       // Seconds of measurement, after the warmup
+        double warmup = 5;          // Seconds for jopa to settle its ringbuffers
+        double interval = 1;        // Seconds between impulses
+        double max_latency = 0;     // Fail above this many seconds, 0 to never fail
+        unsigned max_missed = 0;    // Fail above this many missed impulses
+
+    };
+
+    void init(Options const& options);
+    int run();
+    ~JopaLoopback();
+
+private:
+
+    static constexpr float impulse_amplitude = 0.5f;
+    static constexpr float detect_threshold = 0.25f;
+
+    // Filled by the process callback, drained by run
+    struct Event {
+
+        int port;           // Index into returns, or -1 for an impulse sent
+        uint64_t frame;
+
+    };
+
+    struct Return {
+
+        std::string name;
+        jack_port_t* port = nullptr;
+        uint64_t holdoff_until = 0;     // Process thread only, skips the tail of a detected impulse
+
+        // Main thread only
+        uint64_t pending = 0;           // Frame of the impulse not yet heard back, 0 if none
+        unsigned heard = 0;
+        unsigned missed = 0;
+        unsigned spurious = 0;
+        std::vector<double> latencies;
+
+    };
+
+    jack_client_t* jack_client = nullptr;
+    jack_port_t* output_port = nullptr;
+    jack_ringbuffer_t* events = nullptr;
+    std::vector<Return> returns;
+    jack_nframes_t sample_rate = 0;
+    uint64_t interval_frames = 0;
+    uint64_t position = 0;
+    std::atomic<uint64_t> jack_xruns { 0 };
+    std::atomic<uint64_t> lost_events { 0 };
+    Options options;
+
+    static int jack_on_process(jack_nframes_t nframes, void* arg);
+    static int jack_on_xrun(void* arg);
+    void push_event(int port, uint64_t frame);
+    void connect_ports();
+    void handle_event(Event const& event, uint64_t warmup_frames);
+    bool report() const;
+
+};
+
+void JopaLoopback::init(Options const& options_) {
+    options = options_;
+    if(options.return_ports.empty()) {
+        options.return_ports.push_back("JACK over PulseAudio:monitor_1");
+    }
+
+    jack_client = jack_client_open("jopa loopback test", JackNoStartServer, nullptr);
+    if(jack_client == nullptr) {
+        throw std::runtime_error("Unable to connect to the JACK server");
+    }
+    sample_rate = jack_get_sample_rate(jack_client);
+    interval_frames = std::llround(options.interval * sample_rate);
+    if(interval_frames == 0) {
+        throw std::runtime_error("Impulse interval is shorter than a frame");
+    }
+
+    // Room for several seconds of events, the main thread drains it every 100 ms
+    events = jack_ringbuffer_create(4096 * sizeof (Event));
+    if(events == nullptr) {
+        throw std::runtime_error("Unable to create a ringbuffer");
+    }
+    output_port = jack_port_register(jack_client, "impulse_out", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+    if(output_port == nullptr) {
+        throw std::runtime_error("Unable to create JACK ports: impulse_out");
+    }
+    returns.resize(options.return_ports.size());
+    for(size_t i = 0; i < returns.size(); ++i) {
+        std::string port_name = "return_" + std::to_string(i + 1);
+        returns[i].name = options.return_ports[i];
+        returns[i].port = jack_port_register(jack_client, port_name.c_str(), JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+        if(returns[i].port == nullptr) {
+            throw std::runtime_error("Unable to create JACK ports: " + port_name);
+        }
+    }
+
+    if(jack_set_process_callback(jack_client, jack_on_process, this) != 0) {
+        throw std::runtime_error("Unable to register JACK process callback");
+    }
+    if(jack_set_xrun_callback(jack_client, jack_on_xrun, this) != 0) {
+        throw std::runtime_error("Unable to register JACK xrun callback");
+    }
+    if(jack_activate(jack_client) != 0) {
+        throw std::runtime_error("Unable to activate JACK client");
+    }
+    connect_ports();
+}
+
+void JopaLoopback::connect_ports() {
+    // jopa may still be registering its ports when the test starts
+    for(int attempt = 0; ; ++attempt) {
+        bool connected = true;
+        int result = jack_connect(jack_client, jack_port_name(output_port), options.playback_port.c_str());
+        connected = connected && (result == 0 || result == EEXIST);
+        for(Return const& ret : returns) {
+            result = jack_connect(jack_client, ret.name.c_str(), jack_port_name(ret.port));
+            connected = connected && (result == 0 || result == EEXIST);
+        }
+        if(connected) {
+            return;
+        }
+        if(attempt == 100) {
+            throw std::runtime_error("Unable to connect to the jopa ports");
+        }
+        usleep(100000);
+    }
+}
+
+int JopaLoopback::jack_on_process(jack_nframes_t nframes, void* arg) {
+    JopaLoopback* self = static_cast<JopaLoopback*>(arg);
+    float* out = static_cast<float*>(jack_port_get_buffer(self->output_port, nframes));
+    std::memset(out, 0, nframes * sizeof (float));
+    // Frame 0 is never sent, so a pending frame of 0 means none
+    for(jack_nframes_t i = 0; i < nframes; ++i) {
+        uint64_t frame = self->position + i;
+        if(frame != 0 && frame % self->interval_frames == 0) {
+            out[i] = impulse_amplitude;
+            self->push_event(-1, frame);
+        }
+    }
+    for(size_t index = 0; index < self->returns.size(); ++index) {
+        Return& ret = self->returns[index];
+        float const* in = static_cast<float const*>(jack_port_get_buffer(ret.port, nframes));
+        for(jack_nframes_t i = 0; i < nframes; ++i) {
+            uint64_t frame = self->position + i;
+            if(frame >= ret.holdoff_until && std::fabs(in[i]) >= detect_threshold) {
+                self->push_event(index, frame);
+                ret.holdoff_until = frame + self->interval_frames / 2;
+            }
+        }
+    }
+    self->position += nframes;
+    return 0;
+}
+
+int JopaLoopback::jack_on_xrun(void* arg) {
+    JopaLoopback* self = static_cast<JopaLoopback*>(arg);
+    self->jack_xruns.fetch_add(1, std::memory_order_relaxed);
+    return 0;
+}
+
+void JopaLoopback::push_event(int port, uint64_t frame) {
+    Event event = { port, frame };
+    if(jack_ringbuffer_write_space(events) < sizeof event) {
+        lost_events.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    jack_ringbuffer_write(events, reinterpret_cast<char const*>(&event), sizeof event);
+}
+
+void JopaLoopback::handle_event(Event const& event, uint64_t warmup_frames) {
+    if(event.port < 0) {
+        // An impulse still pending when the next one goes out never made it back
+        for(Return& ret : returns) {
+            if(ret.pending != 0 && ret.pending >= warmup_frames) {
+                ++ret.missed;
+            }
+            ret.pending = event.frame;
+        }
+        return;
+    }
+    Return& ret = returns[event.port];
+    if(ret.pending == 0) {
+        if(event.frame >= warmup_frames) {
+            ++ret.spurious;
+        }
+        return;
+    }
+    if(ret.pending >= warmup_frames) {
+        ++ret.heard;
+        ret.latencies.push_back((double) (event.frame - ret.pending) / sample_rate);
+    }
+    ret.pending = 0;
+}
+
+int JopaLoopback::run() {
+    uint64_t warmup_frames = std::llround(options.warmup * sample_rate);
+    uint64_t end_frames = warmup_frames + std::llround(options.duration * sample_rate);
+    uint64_t last_frame = 0;
+    // A stalled JACK graph sends no events, give up well after the expected end
+    long polls_left = std::lround((options.warmup + options.duration) * 10) + 100;
+    while(last_frame < end_frames) {
+        if(polls_left-- == 0) {
+            std::fprintf(stderr, "JACK stopped processing, ending the test early\n");
+            break;
+        }
+        usleep(100000);
+        Event event;
+        while(jack_ringbuffer_read_space(events) >= sizeof event) {
+            jack_ringbuffer_read(events, reinterpret_cast<char*>(&event), sizeof event);
+            if(event.frame >= end_frames) {
+                last_frame = event.frame;
+                break;
+            }
+            handle_event(event, warmup_frames);
+            last_frame = event.frame;
+        }
+    }
+    return report() ? 0 : 1;
+}
+
+bool JopaLoopback::report() const {
+    // Same "key value" lines as jopa --print-stats
+    bool passed = lost_events.load(std::memory_order_relaxed) == 0;
+    std::printf("sample_rate %u\nduration_s %g\ninterval_s %g\n", sample_rate, options.duration, options.interval);
+    std::printf("jack_xruns %llu\nlost_events %llu\n",
+        (unsigned long long) jack_xruns.load(std::memory_order_relaxed), (unsigned long long) lost_events.load(std::memory_order_relaxed));
+    for(size_t index = 0; index < returns.size(); ++index) {
+        Return const& ret = returns[index];
+        std::string prefix = "return" + std::to_string(index) + ".";
+        std::printf("%sport %s\n", prefix.c_str(), ret.name.c_str());
+        std::printf("%sheard %u\n%smissed %u\n%sspurious %u\n", prefix.c_str(), ret.heard, prefix.c_str(), ret.missed, prefix.c_str(), ret.spurious);
+        if(ret.latencies.empty()) {
+            passed = false;
+            continue;
+        }
+        double sum = 0;
+        double min = ret.latencies[0];
+        double max = ret.latencies[0];
+        for(double latency : ret.latencies) {
+            sum += latency;
+            min = std::min(min, latency);
+            max = std::max(max, latency);
+        }
+        double mean = sum / ret.latencies.size();
+        double variance = 0;
+        for(double latency : ret.latencies) {
+            variance += (latency - mean) * (latency - mean);
+        }
+        double jitter = std::sqrt(variance / ret.latencies.size());
+        std::printf("%slatency_min_us %lld\n%slatency_mean_us %lld\n%slatency_max_us %lld\n%sjitter_us %lld\n",
+            prefix.c_str(), std::llround(min * 1e6), prefix.c_str(), std::llround(mean * 1e6),
+            prefix.c_str(), std::llround(max * 1e6), prefix.c_str(), std::llround(jitter * 1e6));
+        if(ret.missed > options.max_missed || (options.max_latency > 0 && max > options.max_latency)) {
+            passed = false;
+        }
+    }
+    std::printf("result %s\n", passed ? "pass" : "fail");
+    return passed;
+}
+
+JopaLoopback::~JopaLoopback() {
+    if(jack_client != nullptr) {
+        jack_deactivate(jack_client);
+        jack_client_close(jack_client);
+    }
+    if(events != nullptr) {
+        jack_ringbuffer_free(events);
+    }
+}
+
+static void print_usage(char const* program) {
+    std::fprintf(stderr,
+        "Usage: %s [options]\n"
+        "\n"
+        "Options:\n"
+        "  -p, --playback=PORT      port to send impulses to\n"
+        "                           (default: \"JACK over PulseAudio:playback_1\")\n"
+        "  -r, --return=PORT        port to listen on, may be repeated\n"
+        "                           (default: \"JACK over PulseAudio:monitor_1\")\n"
+        "  -d, --duration=S         seconds to measure (default: 60)\n"
+        "  -w, --warmup=S           seconds to wait before measuring (default: 5)\n"
+        "  -i, --interval=S         seconds between impulses, must exceed the round\n"
+        "                           trip (default: 1)\n"
+        "  -L, --max-latency=MS     fail if a round trip takes longer\n"
+        "  -m, --max-missed=N       fail if more impulses are lost (default: 0)\n"
+        "  -h, --help               show this help\n",
+        program);
+}
+
+static bool parse_seconds(char const* arg, double scale, double* result) {
+    char* end;
+    double value = std::strtod(arg, &end) * scale;
+    if(end == arg || *end != '\0' || !(value >= 0)) {
+        std::fprintf(stderr, "Invalid duration: %s\n", arg);
+        return false;
+    }
+    *result = value;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    static option const long_options[] = {
+        { "playback",    required_argument, nullptr, 'p' },
+        { "return",      required_argument, nullptr, 'r' },
+        { "duration",    required_argument, nullptr, 'd' },
+        { "warmup",      required_argument, nullptr, 'w' },
+        { "interval",    required_argument, nullptr, 'i' },
+        { "max-latency", required_argument, nullptr, 'L' },
+        { "max-missed",  required_argument, nullptr, 'm' },
+        { "help",        no_argument,       nullptr, 'h' },
+        { nullptr,       0,                 nullptr, 0 }
+    };
+
+    JopaLoopback::Options options;
+    int opt;
+    while((opt = getopt_long(argc, argv, "p:r:d:w:i:L:m:h", long_options, nullptr)) != -1) {
+        switch(opt) {
+        case 'p':
+            options.playback_port = optarg;
+            break;
+        case 'r':
+            options.return_ports.push_back(optarg);
+            break;
+        case 'd':
+            if(!parse_seconds(optarg, 1, &options.duration)) {
+                return 1;
+            }
+            break;
+        case 'w':
+            if(!parse_seconds(optarg, 1, &options.warmup)) {
+                return 1;
+            }
+            break;
+        case 'i':
+            if(!parse_seconds(optarg, 1, &options.interval)) {
+                return 1;
+            }
+            break;
+        case 'L':
+            if(!parse_seconds(optarg, 0.001, &options.max_latency)) {
+                return 1;
+            }
+            break;
+        case 'm':
+            options.max_missed = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if(optind != argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    JopaLoopback loopback;
+    loopback.init(options);
+    return loopback.run();
+}